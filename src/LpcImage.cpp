@@ -0,0 +1,960 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#include <string.h>
+
+#include "LpcImage.hpp"
+
+#include "isplib.h"
+#include "lpc_devices.h"
+#include "crc32.h"
+#include "ihex.h"
+#include "srec.h"
+#include "elf.h"
+#include "uu_encode.h"
+
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL 2
+#endif
+
+enum {
+	RECORD_BAD = -1,
+	RECORD_OTHER,
+	RECORD_DATA,
+	RECORD_END
+};
+
+typedef union {
+	ihex_record_t ihex;
+	srec_record_t srec;
+} text_record_t;
+
+/*! \brief Reads HEX and S-record files a line at a time */
+typedef struct {
+	char buffer[LPCIMAGE_TEXT_BUFFER_SIZE];
+	u32 offset; //file offset of buffer[0]
+	u32 pos;
+	u32 len;
+	u32 end; //file offset to stop at
+} text_reader_t;
+
+static void text_start(File & f, text_reader_t * reader, u32 offset, u32 end){
+	f.seek(offset, File::SET);
+	reader->offset = offset;
+	reader->pos = 0;
+	reader->len = 0;
+	reader->end = end;
+}
+
+/*! \details Returns the next line without its line ending or zero at the end.
+ * \a line_offset is set to the file offset of the line.
+ */
+static char * text_line(File & f, text_reader_t * reader, u32 * line_offset){
+	char * eol;
+	char * line;
+	int bytes;
+
+	while( 1 ){
+		while( (reader->pos < reader->len) &&
+				((reader->buffer[reader->pos] == '\r') || (reader->buffer[reader->pos] == '\n')) ){
+			reader->pos++;
+		}
+
+		if( reader->offset + reader->pos >= reader->end ){
+			return 0;
+		}
+
+		eol = (char*)memchr(reader->buffer + reader->pos, '\n', reader->len - reader->pos);
+		if( eol ){
+			break;
+		}
+
+		if( (reader->pos == 0) && (reader->len == LPCIMAGE_TEXT_BUFFER_SIZE-1) ){
+			//line is too long to be a record
+			return 0;
+		}
+
+		//move the partial line to the front and read more
+		memmove(reader->buffer, reader->buffer + reader->pos, reader->len - reader->pos);
+		reader->offset += reader->pos;
+		reader->len -= reader->pos;
+		reader->pos = 0;
+
+		bytes = f.read(reader->buffer + reader->len, LPCIMAGE_TEXT_BUFFER_SIZE-1 - reader->len);
+		if( bytes > 0 ){
+			reader->len += bytes;
+		} else if( reader->len ){
+			//the last line doesn't have a line ending
+			reader->buffer[reader->len++] = '\n';
+		} else {
+			return 0;
+		}
+	}
+
+	*eol = 0;
+	if( (eol > reader->buffer + reader->pos) && (eol[-1] == '\r') ){
+		eol[-1] = 0;
+	}
+
+	line = reader->buffer + reader->pos;
+	*line_offset = reader->offset + reader->pos;
+	reader->pos = eol - reader->buffer + 1;
+	return line;
+}
+
+/*! \details Parses a HEX or S-record line. Address records update \a base.
+ * Data records set \a addr, \a data and \a size.
+ */
+static int parse_record(u8 format, const char * line, text_record_t * record, u32 * base, u32 * addr, const u8 ** data, u32 * size){
+
+	if( format == LpcImage::FORMAT_SREC ){
+		if( srec_parse_record(line, &record->srec) < 0 ){
+			return RECORD_BAD;
+		}
+
+		if( SREC_IS_DATA(record->srec.type) ){
+			*addr = record->srec.addr;
+			*data = record->srec.data;
+			*size = record->srec.size;
+			return RECORD_DATA;
+		}
+
+		return SREC_IS_END(record->srec.type) ? RECORD_END : RECORD_OTHER;
+	}
+
+	if( ihex_parse_record(line, &record->ihex) < 0 ){
+		return RECORD_BAD;
+	}
+
+	switch(record->ihex.type){
+	case IHEX_DATA:
+		*addr = *base + record->ihex.addr;
+		*data = record->ihex.data;
+		*size = record->ihex.size;
+		return RECORD_DATA;
+	case IHEX_EOF:
+		return RECORD_END;
+	case IHEX_EXTENDED_SEGMENT_ADDR:
+		*base = ((record->ihex.data[0] << 8) | record->ihex.data[1]) << 4;
+		break;
+	case IHEX_EXTENDED_LINEAR_ADDR:
+		*base = ((record->ihex.data[0] << 8) | record->ihex.data[1]) << 16;
+		break;
+	}
+
+	return RECORD_OTHER;
+}
+
+LpcImage::LpcImage(){
+	m_device = 0;
+	m_format = FORMAT_BINARY;
+	m_file_size = 0;
+	m_flash_end = 0;
+	m_end = 0;
+	m_size = 0;
+	m_page_size = 0;
+	m_used_pages = 0;
+	m_checksum_addr = 0;
+	m_checksum = 0;
+	m_is_checksum = false;
+	m_segment_count = 0;
+	m_patch_count = 0;
+	m_sector_count = 0;
+	m_artifact_table = 0;
+	m_cursor_segment = (u32)-1;
+	m_cursor_offset = 0;
+	m_cursor_base = 0;
+	m_cursor_addr = 0;
+	memset(m_page_map, 0, sizeof(m_page_map));
+	memset(m_dirty_map, 0, sizeof(m_dirty_map));
+	memset(m_sector_crc, 0, sizeof(m_sector_crc));
+	memset(&m_artifact, 0, sizeof(m_artifact));
+}
+
+const char * LpcImage::format_name() const {
+	switch(m_format){
+	case FORMAT_HEX: return "Intel HEX";
+	case FORMAT_SREC: return "S-record";
+	case FORMAT_ELF: return "ELF";
+	case FORMAT_ARTIFACT: return "Prepared";
+	}
+	return "binary";
+}
+
+int LpcImage::load(File & f, const char * dev, u32 page_size){
+	const uint32_t artifact_magic = LPC_ARTIFACT_MAGIC;
+	u8 header[LPCIMAGE_HEADER_SIZE];
+	int32_t checksum_addr;
+	u32 bytes;
+	int ret;
+
+	checksum_addr = lpc_device_get_checksum_addr(dev);
+	if( checksum_addr < 0 ){
+		return -2;
+	}
+
+	if( (page_size == 0) || (page_size > LPCIMAGE_MAX_PAGE_SIZE) ){
+		return -3;
+	}
+
+	m_device = dev;
+	m_checksum_addr = checksum_addr;
+	m_file_size = f.size();
+	m_flash_end = lpc_device_get_sector_addr(dev, lpc_device_get_sector_count(dev));
+	m_page_size = page_size;
+	m_segment_count = 0;
+
+	//the format is recognized from the start of the file
+	f.seek(0, File::SET);
+	bytes = f.read(header, ELF_HEADER_SIZE);
+	if( (bytes >= sizeof(uint32_t)) && (memcmp(header, &artifact_magic, sizeof(artifact_magic)) == 0) ){
+		m_format = FORMAT_ARTIFACT;
+		return load_artifact(f);
+	} else if( elf_is_header(header, bytes) ){
+		m_format = FORMAT_ELF;
+		ret = load_elf(f);
+	} else if( (bytes > 0) && (header[0] == ':') ){
+		m_format = FORMAT_HEX;
+		ret = load_text(f);
+	} else if( (bytes > 1) && (header[0] == 'S') && (header[1] >= '0') && (header[1] <= '9') ){
+		m_format = FORMAT_SREC;
+		ret = load_text(f);
+	} else {
+		m_format = FORMAT_BINARY;
+		ret = load_binary(f);
+	}
+
+	if( ret < 0 ){
+		return ret;
+	}
+
+	if( m_segment_count == 0 ){
+		return -1;
+	}
+
+	return prepare(f);
+}
+
+/*! \details Maps the used pages and calculates the vector checksum and sector CRCs
+ * of the loaded segments with the patches applied.
+ */
+int LpcImage::prepare(File & f){
+	u32 pages;
+	u32 addr;
+	u32 end;
+	u32 bytes;
+	u32 i;
+	int j;
+
+	m_end = find_end();
+	m_size = 0;
+	m_used_pages = 0;
+	m_cursor_segment = (u32)-1;
+	memset(m_page_map, 0, sizeof(m_page_map));
+	memset(m_dirty_map, 0, sizeof(m_dirty_map));
+	memset(m_sector_crc, 0, sizeof(m_sector_crc));
+
+	pages = (m_end + m_page_size - 1) / m_page_size;
+	if( pages > LPCIMAGE_MAX_PAGES ){
+		return -3;
+	}
+
+	//sector CRCs are only available when the sector table is known
+	m_sector_count = 0;
+	if( m_flash_end ){
+		m_sector_count = lpc_device_get_sector_number(m_device, m_end - 1) + 1;
+		if( m_sector_count > LPCIMAGE_MAX_SECTORS ){
+			m_sector_count = LPCIMAGE_MAX_SECTORS;
+		}
+	}
+
+	if( update_checksum(f) < 0 ){
+		return -1;
+	}
+
+	for(i=0; i < pages; i++){
+		addr = page_addr(i);
+		if( read_page(f, i, m_page) < 0 ){
+			return -1;
+		}
+
+		for(j=m_page_size-1; j >= 0; j--){
+			if( m_page[j] != 0xFF ){
+				break;
+			}
+		}
+
+		if( j >= 0 ){
+			m_page_map[i/32] |= (1<<(i%32));
+			m_used_pages++;
+			m_size = addr + j + 1;
+		}
+
+		add_sector_crc(addr, m_page, m_page_size);
+	}
+
+	//the rest of the last sector is blank
+	if( m_sector_count ){
+		end = lpc_device_get_sector_addr(m_device, m_sector_count);
+		memset(m_page, 0xFF, m_page_size);
+		for(addr = page_addr(pages); addr < end; addr += bytes){
+			bytes = end - addr;
+			if( bytes > m_page_size ){
+				bytes = m_page_size;
+			}
+			add_sector_crc(addr, m_page, bytes);
+		}
+	}
+
+	isplib_debug(DEBUG_LEVEL, "%s image %ld bytes in %ld segments to 0x%lX (0x%lX used), %ld of %ld pages used, checksum 0x%08lX",
+			format_name(), m_file_size, m_segment_count, m_end, m_size, m_used_pages, pages, m_checksum);
+
+	return 0;
+}
+
+/*! \details Brings the page map, vector checksum and sector CRCs up to date
+ * after the patches changed. Only the pages the old and new patches touch
+ * and the sectors they are in are read again.
+ */
+int LpcImage::update(File & f){
+	u32 pages;
+	u32 sector;
+	u32 last_sector;
+	u32 i;
+	int j;
+
+	if( m_format == FORMAT_ARTIFACT ){
+		//the pages are already encoded
+		return m_patch_count ? -4 : 0;
+	}
+
+	if( (m_page_size == 0) || (find_end() != m_end) ){
+		//the patches changed the extent of the image
+		return prepare(f);
+	}
+
+	pages = (m_end + m_page_size - 1) / m_page_size;
+
+	if( is_dirty(0) && (update_checksum(f) < 0) ){
+		return -1;
+	}
+
+	last_sector = (u32)-1;
+	for(i=0; i < pages; i++){
+		if( is_dirty(i) == false ){
+			continue;
+		}
+
+		if( read_page(f, i, m_page) < 0 ){
+			return -1;
+		}
+
+		for(j=m_page_size-1; (j >= 0) && (m_page[j] == 0xFF); j--){
+			;
+		}
+
+		if( is_page_used(i) ){
+			m_used_pages--;
+		}
+		m_page_map[i/32] &= ~(1<<(i%32));
+		if( j >= 0 ){
+			m_page_map[i/32] |= (1<<(i%32));
+			m_used_pages++;
+		}
+
+		if( m_sector_count == 0 ){
+			continue;
+		}
+
+		sector = lpc_device_get_sector_number(m_device, page_addr(i));
+		if( (sector != last_sector) && (sector < m_sector_count) ){
+			last_sector = sector;
+			if( calc_sector_crc(f, sector) < 0 ){
+				return -1;
+			}
+		}
+	}
+
+	//the last used page may have changed
+	m_size = 0;
+	for(i=pages; i > 0; i--){
+		if( is_page_used(i-1) ){
+			if( read_page(f, i-1, m_page) < 0 ){
+				return -1;
+			}
+			for(j=m_page_size-1; (j >= 0) && (m_page[j] == 0xFF); j--){
+				;
+			}
+			m_size = page_addr(i-1) + j + 1;
+			break;
+		}
+	}
+
+	memset(m_dirty_map, 0, sizeof(m_dirty_map));
+	return 0;
+}
+
+/*! \details Patches \a size bytes of \a data over the image at \a addr.
+ * Call update() (or load()) before reading pages.
+ * \return Zero on success or -1 if the patch list is full or the patch is too big
+ */
+int LpcImage::add_patch(u32 addr, const void * data, u32 size){
+	lpc_image_patch_t * patch;
+
+	if( (m_patch_count == LPCIMAGE_MAX_PATCHES) || (size == 0) || (size > LPCIMAGE_MAX_PATCH_SIZE) ){
+		return -1;
+	}
+
+	patch = m_patch + m_patch_count;
+	patch->addr = addr;
+	patch->size = size;
+	memcpy(patch->data, data, size);
+	m_patch_count++;
+	mark_dirty(addr, size);
+	return 0;
+}
+
+void LpcImage::clear_patches(){
+	u32 i;
+	for(i=0; i < m_patch_count; i++){
+		mark_dirty(m_patch[i].addr, m_patch[i].size);
+	}
+	m_patch_count = 0;
+}
+
+void LpcImage::mark_dirty(u32 addr, u32 size){
+	u32 page;
+	if( m_page_size == 0 ){
+		return;
+	}
+	for(page = addr / m_page_size; (page <= (addr + size - 1) / m_page_size) && (page < LPCIMAGE_MAX_PAGES); page++){
+		m_dirty_map[page/32] |= (1<<(page%32));
+	}
+}
+
+/*! \details Returns the address after the last segment or patch */
+u32 LpcImage::find_end() const {
+	u32 end;
+	u32 i;
+
+	end = 0;
+	for(i=0; i < m_segment_count; i++){
+		if( m_segment[i].addr + m_segment[i].size > end ){
+			end = m_segment[i].addr + m_segment[i].size;
+		}
+	}
+
+	for(i=0; i < m_patch_count; i++){
+		if( m_patch[i].addr + m_patch[i].size > end ){
+			end = m_patch[i].addr + m_patch[i].size;
+		}
+	}
+
+	return end;
+}
+
+/*! \details Calculates the vector checksum that makes the vectors add up to zero */
+int LpcImage::update_checksum(File & f){
+	uint32_t word;
+	u32 i;
+
+	m_checksum = 0;
+	m_is_checksum = false;
+	if( is_covered(0, m_checksum_addr + sizeof(word)) == false ){
+		return 0;
+	}
+
+	if( read_page(f, 0, m_page) < 0 ){
+		return -1;
+	}
+
+	for(i=0; i < m_checksum_addr/4; i++){
+		memcpy(&word, m_page + i*4, sizeof(word));
+		m_checksum += word;
+	}
+	m_checksum = (uint32_t)(m_checksum*-1);
+	m_is_checksum = true;
+	return 0;
+}
+
+/*! \details Calculates the CRC of \a sector from the image pages */
+int LpcImage::calc_sector_crc(File & f, u32 sector){
+	u32 loc;
+	u32 end;
+	u32 offset;
+	u32 bytes;
+
+	loc = lpc_device_get_sector_addr(m_device, sector);
+	end = lpc_device_get_sector_addr(m_device, sector+1);
+	m_sector_crc[sector] = 0;
+	for(; loc < end; loc += bytes){
+		offset = loc % m_page_size;
+		bytes = m_page_size - offset;
+		if( bytes > end - loc ){
+			bytes = end - loc;
+		}
+
+		if( read_page(f, loc / m_page_size, m_page) < 0 ){
+			return -1;
+		}
+		m_sector_crc[sector] = crc32_calc(m_sector_crc[sector], m_page + offset, bytes);
+	}
+	return 0;
+}
+
+int LpcImage::load_binary(File & f){
+	if( m_file_size == 0 ){
+		return -1;
+	}
+	return add_segment(0, m_file_size, 0, m_file_size, 0);
+}
+
+int LpcImage::load_elf(File & f){
+	u8 buffer[ELF_HEADER_SIZE];
+	elf_header_t header;
+	elf_program_header_t program_header;
+	u32 i;
+
+	f.seek(0, File::SET);
+	if( (f.read(buffer, ELF_HEADER_SIZE) != ELF_HEADER_SIZE) ||
+			(elf_parse_header(buffer, ELF_HEADER_SIZE, &header) < 0) ){
+		return -1;
+	}
+
+	for(i=0; i < header.phnum; i++){
+		f.seek(header.phoff + i*header.phentsize, File::SET);
+		if( (f.read(buffer, ELF_PROGRAM_HEADER_SIZE) != ELF_PROGRAM_HEADER_SIZE) ||
+				(elf_parse_program_header(buffer, ELF_PROGRAM_HEADER_SIZE, &program_header) < 0) ){
+			return -1;
+		}
+
+		if( (program_header.type != ELF_PT_LOAD) || (program_header.filesz == 0) ){
+			continue;
+		}
+
+		if( program_header.offset + program_header.filesz > m_file_size ){
+			return -1;
+		}
+
+		//segments are programmed at their load address
+		if( add_segment(program_header.paddr, program_header.filesz, program_header.offset, program_header.filesz, 0) < 0 ){
+			return -3;
+		}
+	}
+
+	return 0;
+}
+
+/*! \details Loads the plan of an artifact made for the same device and page size.
+ * The image data isn't read until the pages are.
+ */
+int LpcImage::load_artifact(File & f){
+	lpc_artifact_segment_t segment;
+	uint32_t table[64];
+	uint32_t crc;
+	u32 offset;
+	u32 count;
+	u32 i;
+	u32 j;
+
+	f.seek(0, File::SET);
+	if( f.read(&m_artifact, sizeof(m_artifact)) != (int)sizeof(m_artifact) ){
+		return -1;
+	}
+
+	m_artifact.device[LPC_ARTIFACT_DEVICE_SIZE-1] = 0;
+	m_artifact.source[LPC_ARTIFACT_PATH_SIZE-1] = 0;
+	if( (m_artifact.version != LPC_ARTIFACT_VERSION) ||
+			(strcmp(m_artifact.device, m_device) != 0) ||
+			(m_artifact.page_size != m_page_size) ||
+			m_patch_count ){
+		return -4;
+	}
+
+	if( (m_artifact.segment_count == 0) ||
+			(m_artifact.segment_count > LPCIMAGE_MAX_SEGMENTS) ||
+			(m_artifact.sector_count > LPCIMAGE_MAX_SECTORS) ||
+			(m_artifact.page_count > LPCIMAGE_MAX_PAGES) ){
+		return -3;
+	}
+
+	for(i=0; i < m_artifact.segment_count; i++){
+		if( f.read(&segment, sizeof(segment)) != (int)sizeof(segment) ){
+			return -1;
+		}
+		m_segment[i].addr = segment.addr;
+		m_segment[i].size = segment.size;
+		m_segment[i].offset = 0;
+		m_segment[i].length = 0;
+		m_segment[i].base = 0;
+	}
+	m_segment_count = m_artifact.segment_count;
+
+	memset(m_sector_crc, 0, sizeof(m_sector_crc));
+	m_sector_count = m_artifact.sector_count;
+	for(i=0; i < m_sector_count; i++){
+		if( f.read(&crc, sizeof(crc)) != (int)sizeof(crc) ){
+			return -1;
+		}
+		m_sector_crc[i] = crc;
+	}
+
+	m_end = m_artifact.end;
+	m_size = m_artifact.size;
+	m_checksum = m_artifact.checksum;
+	m_is_checksum = (m_artifact.o_flags & LPC_ARTIFACT_FLAG_CHECKSUM) != 0;
+	m_used_pages = 0;
+	m_cursor_segment = (u32)-1;
+	memset(m_page_map, 0, sizeof(m_page_map));
+	memset(m_dirty_map, 0, sizeof(m_dirty_map));
+
+	//pages with a record are the pages that are written
+	m_artifact_table = sizeof(m_artifact) + m_segment_count*sizeof(segment) + m_sector_count*sizeof(crc);
+	for(i=0; i < m_artifact.page_count; i += count){
+		count = m_artifact.page_count - i;
+		if( count > sizeof(table)/sizeof(table[0]) ){
+			count = sizeof(table)/sizeof(table[0]);
+		}
+
+		offset = count*sizeof(uint32_t);
+		if( f.read(table, offset) != (int)offset ){
+			return -1;
+		}
+
+		for(j=0; j < count; j++){
+			if( table[j] ){
+				m_page_map[(i+j)/32] |= (1<<((i+j)%32));
+				m_used_pages++;
+			}
+		}
+	}
+
+	if( m_used_pages != m_artifact.used_pages ){
+		return -1;
+	}
+
+	isplib_debug(DEBUG_LEVEL, "Prepared image of %s for %s to 0x%lX (0x%lX used), %ld pages, checksum 0x%08lX",
+			m_artifact.source, m_artifact.device, m_end, m_size, m_used_pages, m_checksum);
+
+	return 0;
+}
+
+int LpcImage::load_text(File & f){
+	text_reader_t reader;
+	text_record_t record;
+	const u8 * data;
+	char * line;
+	u32 offset;
+	u32 base;
+	u32 addr;
+	u32 size;
+	int ret;
+
+	base = 0;
+	text_start(f, &reader, 0, m_file_size);
+	while( (line = text_line(f, &reader, &offset)) != 0 ){
+		ret = parse_record(m_format, line, &record, &base, &addr, &data, &size);
+		if( ret == RECORD_BAD ){
+			isplib_error("Bad record at offset %ld", offset);
+			return -1;
+		}
+
+		if( ret == RECORD_END ){
+			break;
+		}
+
+		if( (ret == RECORD_DATA) && size ){
+			if( add_segment(addr, size, offset, reader.offset + reader.pos - offset, base) < 0 ){
+				return -3;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*! \details Adds data at \a addr to the segment list. HEX and S-record data
+ * that continues the last segment within a page is added to it.
+ * \return Zero on success or -3 if the segment list is full
+ */
+int LpcImage::add_segment(u32 addr, u32 size, u32 offset, u32 length, u32 base){
+	lpc_image_segment_t * last;
+	u32 last_end;
+
+	if( m_flash_end && (addr + size > m_flash_end) ){
+		isplib_debug(DEBUG_LEVEL, "Skip 0x%lX:%ld (not in flash)", addr, size);
+		return 0;
+	}
+
+	if( m_segment_count && (m_format != FORMAT_BINARY) && (m_format != FORMAT_ELF) ){
+		last = m_segment + m_segment_count - 1;
+		last_end = last->addr + last->size;
+		if( (addr >= last_end) && (addr - last_end < m_page_size) ){
+			last->size = addr + size - last->addr;
+			last->length = offset + length - last->offset;
+			return 0;
+		}
+	}
+
+	if( m_segment_count == LPCIMAGE_MAX_SEGMENTS ){
+		//merging across the gap would erase flash the image doesn't use
+		isplib_debug(DEBUG_LEVEL, "Too many segments at 0x%lX", addr);
+		return -3;
+	}
+
+	m_segment[m_segment_count].addr = addr;
+	m_segment[m_segment_count].size = size;
+	m_segment[m_segment_count].offset = offset;
+	m_segment[m_segment_count].length = length;
+	m_segment[m_segment_count].base = base;
+	m_segment_count++;
+	return 0;
+}
+
+int LpcImage::read_page(File & f, u32 page, void * dest) const {
+	const lpc_image_segment_t * segment;
+	u32 addr;
+	u32 start;
+	u32 end;
+	u32 i;
+
+	addr = page_addr(page);
+	memset(dest, 0xFF, m_page_size);
+
+	if( m_format == FORMAT_ARTIFACT ){
+		return read_artifact_page(f, page, (u8*)dest);
+	}
+
+	for(i=0; i < m_segment_count; i++){
+		segment = m_segment + i;
+		start = segment->addr > addr ? segment->addr : addr;
+		end = segment->addr + segment->size;
+		if( end > addr + m_page_size ){
+			end = addr + m_page_size;
+		}
+
+		if( start >= end ){
+			continue;
+		}
+
+		if( (m_format == FORMAT_BINARY) || (m_format == FORMAT_ELF) ){
+			f.seek(segment->offset + start - segment->addr, File::SET);
+			if( f.read((u8*)dest + start - addr, end - start) != (int)(end - start) ){
+				return -1;
+			}
+		} else if( read_records(f, i, addr, (u8*)dest) < 0 ){
+			return -1;
+		}
+	}
+
+	for(i=0; i < m_patch_count; i++){
+		start = m_patch[i].addr > addr ? m_patch[i].addr : addr;
+		end = m_patch[i].addr + m_patch[i].size;
+		if( end > addr + m_page_size ){
+			end = addr + m_page_size;
+		}
+
+		if( start < end ){
+			memcpy((u8*)dest + start - addr, m_patch[i].data + start - m_patch[i].addr, end - start);
+		}
+	}
+
+	if( (page == 0) && m_is_checksum ){
+		patch_checksum((u8*)dest);
+	}
+
+	return 0;
+}
+
+int LpcImage::read_encoded(File & f, u32 page, lpc_artifact_page_t * header, void * dest, u32 dest_size) const {
+	uint32_t offset;
+
+	if( m_format != FORMAT_ARTIFACT ){
+		return -1;
+	}
+
+	//pages past the end of the image are blank like in the other formats
+	if( (page >= m_artifact.page_count) || (is_page_used(page) == false) ){
+		return 0;
+	}
+
+	f.seek(m_artifact_table + page*sizeof(offset), File::SET);
+	if( f.read(&offset, sizeof(offset)) != (int)sizeof(offset) ){
+		return -1;
+	}
+
+	f.seek(offset, File::SET);
+	if( (f.read(header, sizeof(lpc_artifact_page_t)) != (int)sizeof(lpc_artifact_page_t)) ||
+			(header->addr != page_addr(page)) ||
+			(header->copy_size > m_page_size) ||
+			(header->size > dest_size) ){
+		return -1;
+	}
+
+	if( f.read(dest, header->size) != (int)header->size ){
+		return -1;
+	}
+
+	return header->size;
+}
+
+/*! \details Decodes the record of \a page into \a dest (which is already filled with 0xFF).
+ * The checksum of each block is checked against the one the artifact will send.
+ */
+int LpcImage::read_artifact_page(File & f, u32 page, u8 * dest) const {
+	char * record = m_encoded;
+	lpc_artifact_page_t header;
+	lpc_artifact_block_t block;
+	uint32_t checksum;
+	u32 offset;
+	u32 block_size;
+	u32 bytes;
+	int ret;
+
+	if( (ret = read_encoded(f, page, &header, record, LPC_ARTIFACT_MAX_PAGE_SIZE)) <= 0 ){
+		return ret;
+	}
+
+	if( (m_artifact.o_flags & LPC_ARTIFACT_FLAG_UUENCODE) == 0 ){
+		if( header.size != header.copy_size ){
+			return -1;
+		}
+		memcpy(dest, record, header.bytes);
+		return 0;
+	}
+
+	bytes = 0;
+	for(offset=0; offset < header.size; offset += block_size){
+		memcpy(&block, record + offset, sizeof(block));
+		block_size = LPC_ARTIFACT_BLOCK_SIZE(block.frame_size);
+		if( offset + block_size > header.size ){
+			return -1;
+		}
+
+		checksum = 0;
+		if( (uu_decode_block(dest + bytes, header.copy_size - bytes, record + offset + sizeof(block), block.frame_size, 0, &checksum) != block.bytes) ||
+				(checksum != block.checksum) ){
+			return -1;
+		}
+		bytes += block.bytes;
+	}
+
+	return (bytes == header.copy_size) ? 0 : -1;
+}
+
+/*! \details Copies the data records of segment \a index that fall in the page at \a addr to \a dest. */
+int LpcImage::read_records(File & f, u32 index, u32 addr, u8 * dest) const {
+	const lpc_image_segment_t * segment = m_segment + index;
+	text_reader_t reader;
+	text_record_t record;
+	const u8 * data;
+	char * line;
+	u32 offset;
+	u32 base;
+	u32 record_addr;
+	u32 size;
+	u32 start;
+	u32 end;
+	int ret;
+
+	//records in a segment are in address order so reading can resume where the last page stopped
+	if( (m_cursor_segment == index) && (m_cursor_addr <= addr) ){
+		text_start(f, &reader, m_cursor_offset, segment->offset + segment->length);
+		base = m_cursor_base;
+	} else {
+		text_start(f, &reader, segment->offset, segment->offset + segment->length);
+		base = segment->base;
+	}
+
+	while( (line = text_line(f, &reader, &offset)) != 0 ){
+		ret = parse_record(m_format, line, &record, &base, &record_addr, &data, &size);
+		if( ret == RECORD_BAD ){
+			return -1;
+		}
+
+		if( ret == RECORD_END ){
+			break;
+		}
+
+		if( ret != RECORD_DATA ){
+			continue;
+		}
+
+		if( record_addr >= addr + m_page_size ){
+			break;
+		}
+
+		m_cursor_segment = index;
+		m_cursor_offset = offset;
+		m_cursor_base = base;
+		m_cursor_addr = record_addr;
+
+		start = record_addr > addr ? record_addr : addr;
+		end = record_addr + size;
+		if( end > addr + m_page_size ){
+			end = addr + m_page_size;
+		}
+
+		if( start < end ){
+			memcpy(dest + start - addr, data + start - record_addr, end - start);
+		}
+	}
+
+	return 0;
+}
+
+bool LpcImage::is_covered(u32 addr, u32 size) const {
+	u32 i;
+	for(i=0; i < m_segment_count; i++){
+		if( (m_segment[i].addr <= addr) && (m_segment[i].addr + m_segment[i].size >= addr + size) ){
+			return true;
+		}
+	}
+	return false;
+}
+
+void LpcImage::patch_checksum(u8 * page) const {
+	uint32_t checksum = m_checksum;
+	if( m_checksum_addr + sizeof(checksum) <= m_page_size ){
+		memcpy(page + m_checksum_addr, &checksum, sizeof(checksum));
+	}
+}
+
+void LpcImage::add_sector_crc(u32 addr, const u8 * data, u32 size){
+	u32 sector;
+	u32 end;
+	u32 bytes;
+
+	while( size ){
+		sector = lpc_device_get_sector_number(m_device, addr);
+		if( sector >= m_sector_count ){
+			return;
+		}
+
+		end = lpc_device_get_sector_addr(m_device, sector+1);
+		bytes = end - addr;
+		if( bytes > size ){
+			bytes = size;
+		}
+
+		m_sector_crc[sector] = crc32_calc(m_sector_crc[sector], data, bytes);
+		addr += bytes;
+		data += bytes;
+		size -= bytes;
+	}
+}
@@ -0,0 +1,214 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+#ifndef LPCIMAGE_HPP_
+#define LPCIMAGE_HPP_
+
+#include <string.h>
+#include <sapi/sys.hpp>
+
+#include "lpc_artifact.h"
+
+#define LPCIMAGE_MAX_PAGES 2048 //512KB in 256 byte copies
+#define LPCIMAGE_MAX_PAGE_SIZE 4096 //largest copy RAM to flash
+#define LPCIMAGE_MAX_SECTORS 128
+#define LPCIMAGE_MAX_SEGMENTS 32
+#define LPCIMAGE_TEXT_BUFFER_SIZE 1024 //holds the longest Intel HEX or S-record line
+#define LPCIMAGE_MAX_PATCHES 8
+#define LPCIMAGE_MAX_PATCH_SIZE 256
+#define LPCIMAGE_HEADER_SIZE 64 //bytes read to recognize the format (holds an ELF header)
+
+/*! \brief A range of flash the image has data for */
+typedef struct {
+	u32 addr; //flash address of the first byte
+	u32 size; //bytes from addr to the end of the segment
+	u32 offset; //file offset of the data (binary and ELF) or the first record (HEX and S-record)
+	u32 length; //file bytes the records take up (HEX and S-record)
+	u32 base; //Intel HEX address base in effect at the first record
+} lpc_image_segment_t;
+
+/*! \brief Bytes written over the image (e.g. a serial number) */
+typedef struct {
+	u32 addr;
+	u32 size;
+	u8 data[LPCIMAGE_MAX_PATCH_SIZE];
+} lpc_image_patch_t;
+
+/*! \brief An image prepared for programming
+ * \details load() reads the image file once. Raw binaries, Intel HEX,
+ * Motorola S-records and ELF files (PT_LOAD program headers) are
+ * accepted. The file is parsed into a list of segments, the flash
+ * ranges that have data. HEX and S-record runs less than a page apart
+ * are coalesced into one segment with 0xFF in the gap.
+ *
+ * load() then patches the vector checksum (if the image covers it),
+ * finds the last byte that isn't 0xFF, maps which copy pages have data
+ * and calculates the CRC of each sector up to the end of the image.
+ *
+ * Pages are read from the file again with read_page() when they are
+ * written, so the whole image doesn't have to fit in RAM.
+ *
+ * Patches are applied over the file data. When the patches change (for
+ * example, a serial number for each unit), update() only re-reads the
+ * pages and sectors the patches touch; the rest of the prepared image is reused.
+ *
+ * An artifact made by LpcIsp::prepare() (see lpc_artifact.h) is loaded
+ * without reading any image data: the segments, checksum, page map and
+ * sector CRCs come from its header. read_encoded() returns a page as the
+ * uuencoded blocks that are sent to the device.
+ */
+class LpcImage {
+public:
+	LpcImage();
+
+	enum {
+		FORMAT_BINARY /*! Raw binary programmed at address 0 */,
+		FORMAT_HEX /*! Intel HEX */,
+		FORMAT_SREC /*! Motorola S-record */,
+		FORMAT_ELF /*! 32-bit ARM ELF */,
+		FORMAT_ARTIFACT /*! Prepared image (see lpc_artifact.h) */
+	};
+
+	/*! \details Prepares the image in \a f for \a dev using copies of \a page_size bytes.
+	 * Patches that were added are applied.
+	 * \return Zero on success, -1 if the file can't be read or parsed, -2 if the device isn't supported,
+	 * -3 if the image doesn't fit in the page or segment map or -4 if an artifact was prepared for
+	 * another device, page size or version or patches are set (an artifact can't be patched)
+	 */
+	int load(File & f, const char * dev, u32 page_size);
+
+	/*! \details Returns true if the image was loaded for \a dev with \a page_size pages from a file of \a file_size bytes */
+	bool is_loaded(const char * dev, u32 page_size, u32 file_size) const {
+		return m_device && (strcmp(m_device, dev) == 0) && (m_page_size == page_size) && (m_file_size == file_size);
+	}
+
+	/*! \details Updates a loaded image after the patches change */
+	int update(File & f);
+
+	int add_patch(u32 addr, const void * data, u32 size);
+	/*! \details Removes all patches (update() restores the image data under them) */
+	void clear_patches();
+	u32 patch_count() const { return m_patch_count; }
+	const lpc_image_patch_t & patch(u32 i) const { return m_patch[i]; }
+
+	/*! \details Reads \a page from \a f into \a dest (0xFF outside the segments with the patches and vector checksum applied) */
+	int read_page(File & f, u32 page, void * dest) const;
+
+	/*! \details Reads the record of \a page from an artifact: \a header and up to \a dest_size bytes of blocks in \a dest.
+	 * \return Number of bytes in \a dest, zero if the artifact doesn't write \a page (or it is past the end) or -1 on error
+	 */
+	int read_encoded(File & f, u32 page, lpc_artifact_page_t * header, void * dest, u32 dest_size) const;
+	/*! \details Returns true if read_encoded() has uuencoded blocks for the pages */
+	bool is_encoded() const { return (m_format == FORMAT_ARTIFACT) && (m_artifact.o_flags & LPC_ARTIFACT_FLAG_UUENCODE); }
+	/*! \details Header of a loaded artifact (source file, CRC and chunk size) */
+	const lpc_artifact_header_t & artifact() const { return m_artifact; }
+
+	/*! \details Returns a scratch page for reading pages with read_page(). It is shared with
+	 * load() and update(), so its contents don't survive those calls.
+	 */
+	u8 * page_buffer(){ return m_page; }
+	/*! \details Returns a scratch buffer for read_encoded(). Reading an artifact page
+	 * with read_page() uses it too.
+	 */
+	char * encoded_buffer(){ return m_encoded; }
+
+	u8 format() const { return m_format; }
+	const char * format_name() const;
+
+	u32 segment_count() const { return m_segment_count; }
+	const lpc_image_segment_t & segment(u32 i) const { return m_segment[i]; }
+
+	/*! \details Address after the last segment */
+	u32 end() const { return m_end; }
+	/*! \details Address after the last byte that isn't 0xFF */
+	u32 size() const { return m_size; }
+	u32 page_size() const { return m_page_size; }
+	u32 page_count() const { return m_page_size ? (m_size + m_page_size - 1) / m_page_size : 0; }
+	u32 page_addr(u32 page) const { return page * m_page_size; }
+	/*! \details Number of image bytes in \a page (less than page_size() for the last page) */
+	u32 page_bytes(u32 page) const {
+		return (m_size - page_addr(page) < m_page_size) ? m_size - page_addr(page) : m_page_size;
+	}
+	/*! \details Returns true if \a page has bytes that aren't 0xFF */
+	bool is_page_used(u32 page) const {
+		return (page < LPCIMAGE_MAX_PAGES) && (m_page_map[page/32] & (1<<(page%32)));
+	}
+	u32 used_pages() const { return m_used_pages; }
+
+	/*! \details Number of sectors up to the end of the image (zero if the sector table isn't known) */
+	u32 sector_count() const { return m_sector_count; }
+	/*! \details CRC32 of \a sector as it will be programmed (0xFF outside the segments) */
+	u32 sector_crc(u32 sector) const { return sector < m_sector_count ? m_sector_crc[sector] : 0; }
+
+	/*! \details Returns true if the image covers the vector checksum */
+	bool is_checksum() const { return m_is_checksum; }
+	/*! \details Value written to the vector checksum */
+	u32 checksum() const { return m_checksum; }
+
+private:
+	int prepare(File & f);
+	int update_checksum(File & f);
+	int calc_sector_crc(File & f, u32 sector);
+	u32 find_end() const;
+	void mark_dirty(u32 addr, u32 size);
+	bool is_dirty(u32 page) const {
+		return (page < LPCIMAGE_MAX_PAGES) && (m_dirty_map[page/32] & (1<<(page%32)));
+	}
+	int load_binary(File & f);
+	int load_text(File & f);
+	int load_elf(File & f);
+	int load_artifact(File & f);
+	int read_artifact_page(File & f, u32 page, u8 * dest) const;
+	int add_segment(u32 addr, u32 size, u32 offset, u32 length, u32 base);
+	int read_records(File & f, u32 index, u32 addr, u8 * dest) const;
+	bool is_covered(u32 addr, u32 size) const;
+	void patch_checksum(u8 * page) const;
+	void add_sector_crc(u32 addr, const u8 * data, u32 size);
+
+	const char * m_device;
+	u8 m_format;
+	u32 m_file_size;
+	u32 m_flash_end; //zero if the sector table isn't known
+	u32 m_end;
+	u32 m_size;
+	u32 m_page_size;
+	u32 m_used_pages;
+	u32 m_checksum_addr;
+	u32 m_checksum;
+	bool m_is_checksum;
+	lpc_image_segment_t m_segment[LPCIMAGE_MAX_SEGMENTS];
+	u32 m_segment_count;
+	u32 m_page_map[LPCIMAGE_MAX_PAGES/32];
+	u32 m_dirty_map[LPCIMAGE_MAX_PAGES/32]; //pages patches changed since the last update
+	lpc_image_patch_t m_patch[LPCIMAGE_MAX_PATCHES];
+	u32 m_patch_count;
+	u32 m_sector_count;
+	u32 m_sector_crc[LPCIMAGE_MAX_SECTORS];
+	lpc_artifact_header_t m_artifact;
+	u32 m_artifact_table; //file offset of the artifact page table
+	u8 m_page[LPCIMAGE_MAX_PAGE_SIZE]; //scratch page (see page_buffer())
+	mutable char m_encoded[LPC_ARTIFACT_MAX_PAGE_SIZE]; //scratch record (see encoded_buffer())
+
+	//where read_records() left off so pages read in order don't parse a segment from the start
+	mutable u32 m_cursor_segment;
+	mutable u32 m_cursor_offset;
+	mutable u32 m_cursor_base;
+	mutable u32 m_cursor_addr;
+
+};
+
+#endif /* LPCIMAGE_HPP_ */
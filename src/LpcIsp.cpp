@@ -17,6 +17,7 @@ limitations under the License.
  */
 
 #include <stdarg.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
 
@@ -26,6 +27,9 @@ limitations under the License.
 
 #include "isplib.h"
 #include "lpc_devices.h"
+#include "crc32.h"
+#include "ihex.h"
+#include "UuEncodePipeline.hpp"
 
 #ifndef DEBUG_LEVEL
 #define DEBUG_LEVEL 2
@@ -49,6 +53,7 @@ static const char * device_list[] = {
 		NULL
 };
 
+static int calc_file_crc(File & f, uint32_t * crc);
 
 int LpcIsp::copy_names(char * device, char * pio0, char * pio1){
 	strcpy(device, "lpc");
@@ -61,15 +66,21 @@ int LpcIsp::copy_names(char * device, char * pio0, char * pio1){
 int LpcIsp::program(const char * filename, int crystal, const char * dev){
 	int ret;
 	File f;
-	u8 image_buffer[LPCPHY_RAM_BUFFER_SIZE];
-	int image_page_size = LPCPHY_RAM_BUFFER_SIZE;
+	u8 * image_buffer;
+	char * encoded;
+	lpc_artifact_page_t record;
 	u32 size;
-	u32 bytes_read;
-	u32 start_address;
+	u32 page;
+	u32 page_size;
+	u32 addr;
 	u8 failed;
+	uint32_t crc;
 	u32 bytes_written = 0;
 
-	m_device = dev;
+	image_buffer = m_image.page_buffer();
+	encoded = m_image.encoded_buffer();
+
+	set_device(dev);
 
 	if( strncmp(dev, "lpc8", 4) == 0 ){
 		m_phy.set_max_speed(LpcPhy::MAX_SPEED_9600);
@@ -93,16 +104,7 @@ int LpcIsp::program(const char * filename, int crystal, const char * dev){
 		return ret;
 	}
 
-	status_printf("Erase device");
-	sys::Timer::wait_msec(10);
-	if ( erase_dev() ){
-		m_trace.assign("Erase device");
-		m_trace.trace_error();
-		isplib_error("Failed to erase device");
-		return -1;
-	}
-
-	status_printf("Open binary file");
+	status_printf("Open image file");
 	sys::Timer::wait_msec(10);
 	if( f.open(filename, File::READONLY) < 0 ){
 		m_trace.assign("Didn't open file");
@@ -126,82 +128,160 @@ int LpcIsp::program(const char * filename, int crystal, const char * dev){
 	}
 
 	isplib_debug(DEBUG_LEVEL, "File size is %d", (int)size);
-	memset(image_buffer, 0xFF, image_page_size);
 
-	if( image_page_size > (int)size ){
-		image_page_size = size;
+	m_phy.set_ram_buffer( lpc_device_get_ram_start(dev) );
+	m_phy.set_ram_buffer_size( lpc_device_get_ram_buffer_size(dev) );
+	m_phy.set_ram_window_size( lpc_device_get_ram_size(dev) );
+	snprintf(m_trace.cdata(), m_trace.capacity(), "RAM Start 0x%lX (%ld bytes)", m_phy.ram_buffer(), m_phy.ram_buffer_size());
+	m_trace.trace_message();
+
+	if( m_patch_callback ){
+		//the generator supplies this unit's patches
+		m_image.clear_patches();
+		if( m_patch_callback(m_context, m_unit) ){
+			status_printf("Patch generator failed for unit %ld", m_unit);
+			f.close();
+			return -1;
+		}
 	}
+	m_unit++;
 
-	f.seek(0, File::SET);
+	if( calc_file_crc(f, &crc) < 0 ){
+		isplib_error("Could not read file %s", filename);
+		f.close();
+		return -1;
+	}
 
+	//a prepared image is reused for the next unit if the file is unchanged; only the patched pages are read again
+	if( m_image.is_loaded(dev, m_phy.ram_buffer_size(), f.size()) &&
+			(strcmp(m_image_path, filename) == 0) && (m_image_crc == crc) ){
+		status_printf("Update prepared image (%ld patches)", m_image.patch_count());
+		ret = m_image.update(f);
+	} else {
+		status_printf("Prepare image");
+		ret = m_image.load(f, dev, m_phy.ram_buffer_size());
+		if( (ret == 0) && (m_image.format() == LpcImage::FORMAT_ARTIFACT) && (check_artifact() < 0) ){
+			ret = -5;
+		}
+		strncpy(m_image_path, filename, LPCISP_PATH_SIZE-1);
+		m_image_path[LPCISP_PATH_SIZE-1] = 0;
+		m_image_crc = crc;
+	}
 
-	if ( (int)(bytes_read = f.read(image_buffer, image_page_size)) != image_page_size ){
-		m_trace.assign("Failed to read file");
+	if( ret < 0 ){
+		m_image_path[0] = 0;
+		m_trace.assign("Failed to prepare image");
 		m_trace.trace_error();
-		isplib_error("Could not read file %s (%d of %d bytes read)", filename, bytes_read, size);
+		if( ret == -2 ){
+			status_printf("Device %s is not supported", dev);
+		} else if( ret == -4 ){
+			status_printf("Artifact %s doesn't match %s or has patches (prepare it again)", filename, dev);
+		} else if( ret == -3 ){
+			status_printf("Image is too large for %s", dev);
+		} else if( ret == -5 ){
+			//check_artifact() gave the reason
+		} else {
+			isplib_error("Could not read file %s", filename);
+		}
 		f.close();
 		return -1;
 	}
 
+	status_printf("%s image: %ld segments to 0x%lX, %ld bytes used", m_image.format_name(), m_image.segment_count(), m_image.end(), m_image.size());
+	if( m_image.is_checksum() ){
+		status_printf("Vector checksum 0x%08lX", m_image.checksum());
+	} else {
+		status_printf("Image doesn't cover the vector checksum--not patched");
+	}
+
+	plan_erase();
+
+	if( m_is_delta ){
+		status_printf("Compare sectors");
+		if( plan_delta(f) < 0 ){
+			m_trace.assign("Failed to compare sectors");
+			m_trace.trace_error();
+			f.close();
+			return -1;
+		}
+	}
 
-	start_address = 0;
+	plan_writes();
 
-	isplib_debug(DEBUG_LEVEL, "Starting address is %d", start_address);
+	if( m_is_dry_run ){
+		status_printf("Dry run: programming would take about %ld ms at %ld bps", estimate_msec(), m_phy.baud_rate());
+		prog_shutdown();
+		f.close();
+		return 0;
+	}
 
-	status_printf("Write vector checksum");
-	//Write the patch to the vector checksum
-	if ( write_vector_checksum(image_buffer, dev) ) {
-		sys::Timer::wait_msec(10);
-		m_trace.assign("failed to set checksum");
+	status_printf("Erase device");
+	sys::Timer::wait_msec(10);
+	if ( erase_dev() ){
+		m_trace.assign("Erase device");
 		m_trace.trace_error();
-		isplib_error("Device %s is not supported", dev);
-		printf("Device is not supported");
+		isplib_error("Failed to erase device");
 		f.close();
 		return -1;
 	}
 
-	m_phy.set_ram_buffer( lpc_device_get_ram_start(dev) );
-	snprintf(m_trace.cdata(), m_trace.capacity(), "RAM Start 0x%lX", m_phy.ram_buffer());
-	m_trace.trace_message();
+	m_phy.reset_stats();
 
 	//Write the program memory
 	failed = 0;
 	bytes_written = 0;
-	status_printf("Programming %d bytes at 0x%lX", size, start_address);
-	do {
-
-		if( bytes_written > 0 ){
-			bytes_read = f.read(image_buffer, image_page_size);
+	status_printf("Programming %ld bytes in %ld pages", m_plan_bytes, m_plan_pages);
+	for(page=0; page < m_image.page_count(); page++){
+		if( is_write_page(page) == false ){
+			continue;
 		}
 
-		if( bytes_read > 0 ){
-			if ( !write_progmem(image_buffer, start_address + bytes_written, bytes_read, 0, 0) ){
-				m_trace.assign("failed to write image");
-				m_trace.trace_error();
-				failed = 1;
-				status_printf("Failed to write program memory");
-				f.close();
-				return -1;
+		addr = m_image.page_addr(page);
+		page_size = m_image.page_bytes(page);
+		if( m_image.is_encoded() && m_phy.is_encoded_write() ){
+			//the artifact has the blocks ready to send
+			if( (ret = m_image.read_encoded(f, page, &record, encoded, LPC_ARTIFACT_MAX_PAGE_SIZE)) > 0 ){
+				m_phy.set_encoded(encoded, ret);
+			} else {
+				ret = -1;
 			}
-
-			bytes_written += bytes_read;
 		} else {
-			break;
+			ret = m_image.read_page(f, page, image_buffer);
 		}
 
-		if ( update_progress(bytes_written, size) ){
+		if( (ret < 0) ||
+				(m_phy.write_memory(addr, image_buffer, page_size, lpc_device_get_sector_number(m_device, addr)) != (int)page_size) ){
+			m_trace.sprintf("failed to write 0x%04lX", addr);
+			m_trace.trace_error();
+			status_printf("Failed to write program memory");
+			f.close();
+			return -1;
+		}
+
+		bytes_written += page_size;
+		if ( update_progress(bytes_written, m_plan_bytes) ){
 			m_trace.assign("Aborted");
 			m_trace.trace_warning();
 			return 0; //abort requested
 		}
+	}
 
+	if( m_phy.verify_flush() < 0 ){
+		failed = 1;
+	} else if( m_phy.verify() == LpcPhy::VERIFY_IMAGE ){
+		status_printf("Verify image");
+		if( verify_image(f) < 0 ){
+			failed = 1;
+		}
+	}
 
-	} while( bytes_written < size );
 	prog_shutdown();
 
 	f.close();
 
-	if ( !failed && (bytes_written == size) ){
+	status_stats();
+
+	if ( !failed && (bytes_written == m_plan_bytes) ){
 		status_printf("Device Successfully Programmed");
 	} else {
 		status_printf("Device Failed to program correctly");
@@ -213,20 +293,96 @@ int LpcIsp::program(const char * filename, int crystal, const char * dev){
 
 }
 
+int LpcIsp::verify_image(File & f){
+	u8 * image_buffer;
+	u32 sectors;
+	u32 start;
+	u32 end;
+	u32 end_addr;
+	u32 page;
+	u32 addr;
+
+	image_buffer = m_image.page_buffer();
+
+	if( m_phy.is_read_crc() && (lpc_device_get_sector_count(m_device) > 1) ){
+		sectors = sector_count();
+		if( sectors > LPCISP_MAX_SECTORS ){
+			sectors = LPCISP_MAX_SECTORS;
+		}
+
+		//First sector is mapped to the bootloader so the CRCs start at the second sector
+		for(start=1; start < sectors; start = end+1){
+			for(end = start; (end < sectors) && is_erase_sector(end); end++){
+				;
+			}
+
+			if( end > start ){
+				//one CRC for each run of programmed sectors
+				addr = lpc_device_get_sector_addr(m_device, start);
+				end_addr = lpc_device_get_sector_addr(m_device, end);
+				if( end_addr > ((m_image.end() + 3) & ~0x03) ){
+					end_addr = (m_image.end() + 3) & ~0x03;
+				}
+
+				if( (addr < end_addr) && (compare_image(f, addr, end_addr) != 0) ){
+					status_printf("Failed to verify image CRC at 0x%lX", addr);
+					return -1;
+				}
+			}
+		}
+		return 0;
+	}
+
+	for(page=0; page < m_image.page_count(); page++){
+		addr = m_image.page_addr(page);
+
+		//First sector is mapped to the bootloader and won't compare properly
+		if( (is_write_page(page) == false) || (lpc_device_get_sector_number(m_device, addr) == 0) ){
+			continue;
+		}
+
+		if( (m_image.read_page(f, page, image_buffer) < 0) ||
+				(m_phy.verify_memory(addr, image_buffer, m_image.page_bytes(page)) < 0) ){
+			status_printf("Failed to verify 0x%lX", addr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static bool is_hex_filename(const char * filename){
+	int len = strlen(filename);
+	return (len > 4) && (strcasecmp(filename + len - 4, ".hex") == 0);
+}
+
 int LpcIsp::read(const char * filename, int crystal, const char * dev){
 
 	File f;
-	int bytes_read;
-	int bytes_total;
-	char data[LPCPHY_RAM_BUFFER_SIZE];
-
-	m_device = dev;
+	u32 addr;
+	u32 size;
+	u32 flash_size;
+	u32 page_size;
+	u32 bytes_total;
+	u32 bytes_blank;
+	u32 sector;
+	u32 sector_end;
+	u32 checked_sector;
+	u32 hex_base;
+	bool is_hex;
+	bool is_sparse;
+	bool is_blank;
+	char * data;
+
+	//LPCPHY_READ_SIZE fits in the image's scratch page
+	data = (char*)m_image.page_buffer();
+
+	set_device(dev);
 
 	if( strncmp(dev, "lpc8", 4) == 0 ){
 		m_phy.set_max_speed(LpcPhy::MAX_SPEED_38400);
 		m_phy.set_uuencode(false);
 
-		printf("LPC8xx mode");
 		m_trace.assign("Read LPC8 mode");
 		m_trace.trace_message();
 	} else {
@@ -234,40 +390,480 @@ int LpcIsp::read(const char * filename, int crystal, const char * dev){
 		m_phy.set_uuencode(true);
 	}
 
-	printf("device is %s", m_device);
+	status_printf("Device %s", m_device);
 
 	if ( init_prog_interface(crystal) ){
 		status_printf("Failed to init prog interface");
 		return -1;
 	}
 
+	//without a size, read to the end of flash
+	addr = m_read_addr;
+	size = m_read_size;
+	flash_size = lpc_device_get_sector_addr(m_device, sector_count());
+	if( size == 0 ){
+		if( flash_size <= addr ){
+			status_printf("Flash size of %s isn't known--specify the size to read", m_device);
+			return -1;
+		}
+		size = flash_size - addr;
+	}
+
 	if( f.create(filename) < 0 ){
 		status_printf("Could not create file %s", filename);
 		return -2;
 	}
 
+	//blank sectors are only skipped when the sector table is known
+	is_hex = is_hex_filename(filename);
+	is_sparse = m_is_skip_blank && (lpc_device_get_sector_count(m_device) > 0);
+
+	status_printf("Reading %ld bytes at 0x%lX%s%s", size, addr,
+			is_sparse ? " (skipping blank sectors)" : "",
+			is_hex ? " as Intel HEX" : "");
+	m_phy.reset_stats();
+
 	bytes_total = 0;
-	memset(data, 0x00, LPCPHY_RAM_BUFFER_SIZE);
-	while( (bytes_read = m_phy.read_memory(bytes_total, data, LPCPHY_RAM_BUFFER_SIZE)) > 0 ){
-		printf("Read %d bytes", bytes_read);
-		if ( f.write(data, bytes_read) != bytes_read ){
+	bytes_blank = 0;
+	checked_sector = (u32)-1;
+	hex_base = (u32)-1;
+	is_blank = false;
+	while( bytes_total < size ){
+		page_size = size - bytes_total;
+		if( page_size > LPCPHY_READ_SIZE ){
+			page_size = LPCPHY_READ_SIZE;
+		}
+
+		if( is_sparse ){
+			sector = lpc_device_get_sector_number(m_device, addr + bytes_total);
+			sector_end = lpc_device_get_sector_addr(m_device, sector+1);
+			if( sector_end > addr + bytes_total ){
+				//keep each read within one sector
+				if( page_size > sector_end - (addr + bytes_total) ){
+					page_size = sector_end - (addr + bytes_total);
+				}
+
+				//sector 0 is mapped to the bootloader and won't blank check
+				if( sector != checked_sector ){
+					checked_sector = sector;
+					is_blank = (sector > 0) && (m_phy.blank_check_sector(sector, sector) == 0);
+				}
+			} else {
+				//past the end of the sector table
+				is_blank = false;
+			}
+		}
+
+		if( is_blank ){
+			memset(data, 0xFF, page_size);
+			bytes_blank += page_size;
+		} else if( m_phy.read_memory(addr + bytes_total, data, (page_size + 3) & ~0x03) <= 0 ){
+			//read memory needs a multiple of 4 bytes
+			status_printf("Failed to read 0x%lX", addr + bytes_total);
 			f.close();
-			printf("Failed to write data to file");
 			return -1;
 		}
-		bytes_total += bytes_read;
-		if( bytes_total >= 1024 ){
+
+		if( is_hex ){
+			if( write_hex(f, addr + bytes_total, data, page_size, &hex_base) < 0 ){
+				status_printf("Failed to write data to file");
+				f.close();
+				return -1;
+			}
+		} else if ( f.write(data, page_size) != (int)page_size ){
+			status_printf("Failed to write data to file");
+			f.close();
+			return -1;
+		}
+
+		bytes_total += page_size;
+		if ( update_progress(bytes_total, size) ){
+			m_trace.assign("Aborted");
+			m_trace.trace_warning();
 			break;
 		}
-		memset(data, 0x00, LPCPHY_RAM_BUFFER_SIZE);
+	}
 
+	if( is_hex ){
+		ihex_record(data, IHEX_EOF, 0, 0, 0);
+		f.write(data, strlen(data));
 	}
 
 	f.close();
+	status_printf("Read %ld bytes (%ld blank)", bytes_total, bytes_blank);
+	status_stats();
+
+	return 0;
+}
+
+/*! \details Writes \a data as Intel HEX records leaving out records that are blank (0xFF).
+ * \a hex_base holds the upper address bits of the last extended linear address record.
+ */
+int LpcIsp::write_hex(File & f, u32 addr, const char * data, u32 size, u32 * hex_base){
+	char buf[LPCISP_HEX_BUFFER_SIZE];
+	u8 base[2];
+	u32 len;
+	u32 i;
+	u32 j;
+	u32 record_size;
+
+	len = 0;
+	for(i=0; i < size; i += record_size){
+		record_size = size - i;
+		if( record_size > IHEX_RECORD_BYTES ){
+			record_size = IHEX_RECORD_BYTES;
+		}
+
+		//records can't cross a 64KB boundary
+		if( record_size > 0x10000 - ((addr + i) & 0xFFFF) ){
+			record_size = 0x10000 - ((addr + i) & 0xFFFF);
+		}
+
+		for(j=0; j < record_size; j++){
+			if( data[i+j] != (char)0xFF ){
+				break;
+			}
+		}
+		if( j == record_size ){
+			continue;
+		}
+
+		if( len > LPCISP_HEX_BUFFER_SIZE - 2*IHEX_RECORD_SIZE(IHEX_RECORD_BYTES) ){
+			if( f.write(buf, len) != (int)len ){
+				return -1;
+			}
+			len = 0;
+		}
+
+		if( ((addr + i) >> 16) != *hex_base ){
+			*hex_base = (addr + i) >> 16;
+			base[0] = *hex_base >> 8;
+			base[1] = *hex_base;
+			len += ihex_record(buf + len, IHEX_EXTENDED_LINEAR_ADDR, 0, base, 2);
+		}
+
+		len += ihex_record(buf + len, IHEX_DATA, (addr + i) & 0xFFFF, data + i, record_size);
+	}
+
+	if( len && (f.write(buf, len) != (int)len) ){
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \details This function adds the patches listed in \a path. Each line
+ * has an address followed by the bytes to write there in hex
+ * (e.g. "0x7F000 00 11 22 33"). Lines starting with # are ignored.
+ * \return The number of patches added or -1 on error
+ */
+int LpcIsp::load_patches(const char * path){
+	File f;
+	char line[LPCIMAGE_TEXT_BUFFER_SIZE];
+	u8 data[LPCIMAGE_MAX_PATCH_SIZE];
+	char * p;
+	u32 addr;
+	u32 size;
+	u32 len;
+	int count;
+	int value;
+	bool is_end;
+	char c;
+
+	if( f.open(path, File::READONLY) < 0 ){
+		status_printf("Could not open patch file %s", path);
+		return -1;
+	}
+
+	count = 0;
+	len = 0;
+	is_end = false;
+	while( is_end == false ){
+		//patch files are small so they are read a byte at a time
+		if( f.read(&c, 1) != 1 ){
+			c = '\n';
+			is_end = true;
+		}
+
+		if( (c != '\n') && (c != '\r') ){
+			if( len < LPCIMAGE_TEXT_BUFFER_SIZE-1 ){
+				line[len++] = c;
+			}
+			continue;
+		}
+
+		line[len] = 0;
+		len = 0;
+		p = line;
+		while( isspace(*p) ){
+			p++;
+		}
+
+		if( (*p == 0) || (*p == '#') ){
+			continue;
+		}
+
+		addr = strtoul(p, &p, 0);
+		size = 0;
+		while( *p ){
+			if( isspace(*p) ){
+				p++;
+				continue;
+			}
+
+			if( (size == LPCIMAGE_MAX_PATCH_SIZE) || ((value = ihex_hex_value(p, 2)) < 0) ){
+				status_printf("Bad patch at 0x%lX", addr);
+				f.close();
+				return -1;
+			}
+
+			data[size++] = value;
+			p += 2;
+		}
+
+		if( m_image.add_patch(addr, data, size) < 0 ){
+			status_printf("Could not add patch at 0x%lX (at most %d patches of %d bytes)", addr, LPCIMAGE_MAX_PATCHES, LPCIMAGE_MAX_PATCH_SIZE);
+			f.close();
+			return -1;
+		}
+		count++;
+	}
+
+	f.close();
+	status_printf("Loaded %d patches", count);
+	return count;
+}
+
+/*! \details Calculates the CRC32 of the whole file */
+static int calc_file_crc(File & f, uint32_t * crc){
+	char buffer[LPCIMAGE_TEXT_BUFFER_SIZE];
+	int bytes;
+
+	*crc = 0;
+	f.seek(0, File::SET);
+	while( (bytes = f.read(buffer, LPCIMAGE_TEXT_BUFFER_SIZE)) > 0 ){
+		*crc = crc32_calc(*crc, buffer, bytes);
+	}
+
+	return bytes < 0 ? -1 : 0;
+}
+
+int LpcIsp::prepare(const char * filename, const char * dev, const char * path){
+	lpc_artifact_header_t header;
+	File f;
+	File out;
+	int ret;
+
+	set_device(dev);
+	m_phy.set_uuencode( strncmp(dev, "lpc8", 4) != 0 );
+	m_phy.set_ram_buffer_size( lpc_device_get_ram_buffer_size(dev) );
+
+	status_printf("Device %s\n", dev);
+	status_printf("Image %s\n", filename);
+
+	if( f.open(filename, File::READONLY) < 0 ){
+		status_printf("Could not open file %s", filename);
+		return -1;
+	}
+
+	//program() has to load its image again
+	m_image_path[0] = 0;
+	ret = m_image.load(f, dev, m_phy.ram_buffer_size());
+	if( (ret < 0) || (m_image.format() == LpcImage::FORMAT_ARTIFACT) ){
+		status_printf("Could not prepare %s for %s (%d)", filename, dev, ret);
+		f.close();
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = LPC_ARTIFACT_MAGIC;
+	header.version = LPC_ARTIFACT_VERSION;
+	strncpy(header.device, dev, LPC_ARTIFACT_DEVICE_SIZE-1);
+	strncpy(header.source, filename, LPC_ARTIFACT_PATH_SIZE-1);
+	header.source_size = f.size();
+	header.page_size = m_image.page_size();
+	header.chunk_size = LPCPHY_RAM_BUFFER_SIZE;
+	header.o_flags = 0;
+	if( m_phy.is_uuencode() ){
+		header.o_flags |= LPC_ARTIFACT_FLAG_UUENCODE;
+	}
+	if( m_image.is_checksum() ){
+		header.o_flags |= LPC_ARTIFACT_FLAG_CHECKSUM;
+	}
+	header.checksum = m_image.checksum();
+	header.end = m_image.end();
+	header.size = m_image.size();
+	header.segment_count = m_image.segment_count();
+	header.sector_count = m_image.sector_count();
+	header.page_count = m_image.page_count();
+	header.used_pages = m_image.used_pages();
+
+	if( calc_file_crc(f, &header.source_crc) < 0 ){
+		status_printf("Could not read file %s", filename);
+		f.close();
+		return -1;
+	}
+
+	if( out.create(path) < 0 ){
+		status_printf("Could not create file %s", path);
+		f.close();
+		return -1;
+	}
+
+	status_printf("%s image: %ld segments to 0x%lX, %ld of %ld pages used", m_image.format_name(), m_image.segment_count(), m_image.end(), m_image.used_pages(), m_image.page_count());
+	ret = write_artifact(f, out, header);
+	out.close();
+	f.close();
+
+	if( ret < 0 ){
+		status_printf("Failed to write %s", path);
+		return -1;
+	}
+
+	status_printf("Prepared %s for %s in %s", filename, dev, path);
+	return 0;
+}
+
+/*! \details Writes the plan and the encoded pages of m_image to \a out */
+int LpcIsp::write_artifact(File & f, File & out, const lpc_artifact_header_t & header){
+	u8 * page_buffer = m_image.page_buffer();
+	char * encoded = m_image.encoded_buffer();
+	lpc_artifact_segment_t segment;
+	lpc_artifact_page_t record;
+	uint32_t offset;
+	uint32_t crc;
+	u32 table_offset;
+	u32 page;
+	u32 i;
+
+	if( out.write(&header, sizeof(header)) != (int)sizeof(header) ){
+		return -1;
+	}
+
+	for(i=0; i < header.segment_count; i++){
+		segment.addr = m_image.segment(i).addr;
+		segment.size = m_image.segment(i).size;
+		if( out.write(&segment, sizeof(segment)) != (int)sizeof(segment) ){
+			return -1;
+		}
+	}
+
+	for(i=0; i < header.sector_count; i++){
+		crc = m_image.sector_crc(i);
+		if( out.write(&crc, sizeof(crc)) != (int)sizeof(crc) ){
+			return -1;
+		}
+	}
+
+	//the page table is filled in as the records are written
+	table_offset = sizeof(header) + header.segment_count*sizeof(segment) + header.sector_count*sizeof(crc);
+	offset = 0;
+	for(page=0; page < header.page_count; page++){
+		if( out.write(&offset, sizeof(offset)) != (int)sizeof(offset) ){
+			return -1;
+		}
+	}
+
+	offset = table_offset + header.page_count*sizeof(offset);
+	for(page=0; page < header.page_count; page++){
+		if( m_image.is_page_used(page) == false ){
+			continue;
+		}
+
+		if( m_image.read_page(f, page, page_buffer) < 0 ){
+			return -1;
+		}
+
+		record.addr = m_image.page_addr(page);
+		record.bytes = m_image.page_bytes(page);
+		record.copy_size = m_phy.calc_copy_size(record.bytes);
+		record.size = encode_page(encoded, page_buffer, record.copy_size);
+
+		out.seek(table_offset + page*sizeof(offset), File::SET);
+		if( out.write(&offset, sizeof(offset)) != (int)sizeof(offset) ){
+			return -1;
+		}
+
+		out.seek(offset, File::SET);
+		if( (out.write(&record, sizeof(record)) != (int)sizeof(record)) ||
+				(out.write(encoded, record.size) != (int)record.size) ){
+			return -1;
+		}
+		offset += sizeof(record) + record.size;
+
+		if( update_progress(page+1, header.page_count) ){
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
+/*! \details Splits a page into the checksum blocks write_memory() sends for it.
+ * Blocks don't cross the chunks sent with each write to RAM command.
+ * \return Number of bytes written to \a dest
+ */
+u32 LpcIsp::encode_page(char * dest, const u8 * src, u32 copy_size){
+	uu_block_t uu_block;
+	lpc_artifact_block_t block;
+	u32 chunk_end;
+	u32 offset;
+	u32 size;
+
+	if( m_phy.is_uuencode() == false ){
+		memcpy(dest, src, copy_size);
+		return copy_size;
+	}
+
+	size = 0;
+	for(offset=0; offset < copy_size; offset += uu_block.bytes){
+		chunk_end = (offset / LPCPHY_RAM_BUFFER_SIZE + 1) * LPCPHY_RAM_BUFFER_SIZE;
+		if( chunk_end > copy_size ){
+			chunk_end = copy_size;
+		}
+
+		UuEncodePipeline::encode_block(&uu_block, src + offset, chunk_end - offset);
+		block.frame_size = uu_block.frame_size;
+		block.bytes = uu_block.bytes;
+		block.checksum = uu_block.checksum;
+
+		memset(dest + size, 0, LPC_ARTIFACT_BLOCK_SIZE(block.frame_size));
+		memcpy(dest + size, &block, sizeof(block));
+		memcpy(dest + size + sizeof(block), uu_block.data, uu_block.frame_size);
+		size += LPC_ARTIFACT_BLOCK_SIZE(block.frame_size);
+	}
+
+	return size;
+}
+
+/*! \details Rejects an artifact made with other settings or from an image that changed since */
+int LpcIsp::check_artifact(){
+	const lpc_artifact_header_t & header = m_image.artifact();
+	File source;
+	uint32_t crc;
+	int ret;
+
+	if( (header.chunk_size != LPCPHY_RAM_BUFFER_SIZE) || (m_image.is_encoded() != m_phy.is_uuencode()) ){
+		status_printf("Artifact was prepared with different write settings (prepare it again)");
+		return -1;
+	}
+
+	if( source.open(header.source, File::READONLY) < 0 ){
+		//the artifact can be used without the image
+		status_printf("Source %s not found--artifact not checked", header.source);
+		return 0;
+	}
+
+	ret = calc_file_crc(source, &crc);
+	if( (ret < 0) || (source.size() != header.source_size) || (crc != header.source_crc) ){
+		status_printf("Artifact is stale: %s changed since it was prepared", header.source);
+		ret = -1;
+	}
+
+	source.close();
+	return ret;
+}
+
 char ** LpcIsp::getlist(){
 	return (char**)device_list;
 }
@@ -276,7 +872,11 @@ char ** LpcIsp::getlist(){
 int LpcIsp::init_prog_interface(int crystal){
 	int ret;
 	//Open the ISP interface using phy.open()
+	u32 crc_version;
 	if ( ( ret = m_phy.open(crystal)) == 0 ){
+		crc_version = lpc_device_get_crc_boot_version(m_device);
+		m_phy.set_read_crc( crc_version && (m_phy.boot_version() >= crc_version) );
+		m_phy.set_command_pair( m_is_command_pair && lpc_device_get_command_pair(m_device) );
 		return 0;
 	}
 
@@ -319,105 +919,433 @@ u32 LpcIsp::read_progmem(void * data, u32 addr, u32 size, bool (*progress)(void*
 	return bytes_read;
 }
 
-u32 LpcIsp::write_progmem(void * data, u32 addr, u32 size, bool (*progress)(void*,int, int), void * context){
-	int bytes_written;
-	int page_size;
-	int j;
-	int sector;
-	//char err;
+/*! \details This function counts the pages program() writes: pages that
+ * aren't blank in sectors that are erased.
+ */
+void LpcIsp::plan_writes(){
+	u32 page;
+	u32 erase_sectors;
+	u32 sector;
+
+	m_plan_pages = 0;
+	m_plan_bytes = 0;
+	for(page=0; page < m_image.page_count(); page++){
+		if( is_write_page(page) ){
+			m_plan_pages++;
+			m_plan_bytes += m_image.page_bytes(page);
+		}
+	}
 
-	//First read the buffer size
-	bytes_written = 0;
-	do {
+	erase_sectors = 0;
+	for(sector=0; sector < LPCISP_MAX_SECTORS; sector++){
+		if( is_erase_sector(sector) ){
+			erase_sectors++;
+		}
+	}
 
-		if ( (int)(size-bytes_written) > LPCPHY_RAM_BUFFER_SIZE ){
-			page_size = LPCPHY_RAM_BUFFER_SIZE;
-		} else {
-			page_size = size-bytes_written;
+	status_printf("Plan: erase %ld sectors, write %ld pages (%ld bytes), skip %ld blank and %ld unchanged pages",
+			erase_sectors,
+			m_plan_pages,
+			m_plan_bytes,
+			(m_image.end() + m_image.page_size() - 1) / m_image.page_size() - m_image.used_pages(),
+			m_image.used_pages() - m_plan_pages);
+}
+
+bool LpcIsp::is_write_page(u32 page) const {
+	return m_image.is_page_used(page) &&
+			is_erase_sector(lpc_device_get_sector_number(m_device, m_image.page_addr(page)));
+}
+
+/*! \details This function estimates how long executing the plan takes from
+ * the bytes sent at the current bit rate plus typical flash erase and write times.
+ */
+u32 LpcIsp::estimate_msec() const {
+	u32 bytes;
+	u32 lines;
+	u32 sectors;
+	u32 sector;
+	u32 baud;
+
+	bytes = m_plan_bytes;
+	if( m_phy.is_uuencode() ){
+		//each line carries 45 bytes and each block of 20 lines has a checksum line
+		lines = (m_plan_bytes + UU_LINE_BYTES - 1) / UU_LINE_BYTES;
+		bytes = lines * UU_LINE_SIZE + (lines + UU_BLOCK_LINES - 1) / UU_BLOCK_LINES * UU_CHECKSUM_SIZE;
+	}
+	bytes += m_plan_pages * LPCISP_PAGE_OVERHEAD_BYTES;
+
+	sectors = 0;
+	for(sector=0; sector < LPCISP_MAX_SECTORS; sector++){
+		if( is_erase_sector(sector) ){
+			sectors++;
 		}
+	}
 
-		//Check to see if data is already all 0xFF
-		for(j=0; j < page_size; j++){
-			if ( ((unsigned char*)data)[bytes_written+j] != 0xFF ){
-				break;
-			}
+	baud = m_phy.baud_rate();
+	if( baud == 0 ){
+		baud = 115200;
+	}
+
+	//10 bits per byte on the UART: bytes * 10 * 1000 / baud
+	return bytes * 100 / (baud / 100) +
+			sectors * LPCISP_ERASE_SECTOR_MSEC +
+			m_plan_bytes / 1024 * LPCISP_WRITE_KB_MSEC;
+}
+
+/*! \details This function compares one sector with the image. It uses the
+ * CRC calculated when the image was prepared if the bootloader can read CRCs.
+ * \return Zero if the sector matches, one if it differs and -1 on error
+ */
+int LpcIsp::compare_sector(File & f, u32 sector){
+	u32 start;
+	u32 end;
+	u32 crc;
+	int ret;
+
+	start = lpc_device_get_sector_addr(m_device, sector);
+	end = start + lpc_device_get_sector_size(m_device, sector);
+
+	if( m_phy.is_read_crc() && (sector < m_image.sector_count()) ){
+		ret = m_phy.read_crc(start, end - start, &crc);
+		if( ret == 0 ){
+			isplib_debug(DEBUG_LEVEL+1, "Sector %ld CRC is 0x%lX (image 0x%lX)", sector, crc, m_image.sector_crc(sector));
+			return (crc == m_image.sector_crc(sector)) ? 0 : 1;
 		}
 
-		if ( j < page_size ){ //only write if data has non 0xFF values
-			isplib_debug(DEBUG_LEVEL+1, "lpc_wr_pgmmem():Writing page starting at %d", addr + bytes_written);
-			sector = lpc_device_get_sector_number(m_device, addr+bytes_written);
-			if ( m_phy.write_memory(addr + bytes_written,
-					&((char*)data)[bytes_written], page_size,
-					sector ) != page_size ){
-				printf("failed writing data at address 0x%04lX", (u32)(addr + bytes_written));
-				m_trace.sprintf("failed to write 0x%04lX", (u32)(addr + bytes_written));
-				m_trace.trace_error();
-				return 0;
+		if( (ret < 0) || m_phy.is_read_crc() ){
+			return -1;
+		}
+		//the bootloader doesn't have the command after all
+	}
+
+	return compare_image(f, start, end);
+}
+
+/*! \details This function marks each sector an image segment overlaps in the erase map.
+ * Sectors are marked even where the segment is all 0xFF so that old
+ * contents don't survive in the blank pages program() skips. Sectors
+ * in the gaps between segments aren't touched unless a patch is there.
+ */
+void LpcIsp::plan_erase(){
+	const lpc_image_segment_t * segment;
+	u32 i;
+
+	memset(m_erase_map, 0, sizeof(m_erase_map));
+
+	for(i=0; i < m_image.segment_count(); i++){
+		segment = &m_image.segment(i);
+		plan_erase_range(segment->addr, segment->size);
+	}
+
+	for(i=0; i < m_image.patch_count(); i++){
+		plan_erase_range(m_image.patch(i).addr, m_image.patch(i).size);
+	}
+}
+
+void LpcIsp::plan_erase_range(u32 addr, u32 size){
+	u32 sector;
+	u32 last;
+
+	sector = lpc_device_get_sector_number(m_device, addr);
+	last = lpc_device_get_sector_number(m_device, addr + size - 1);
+	for(; (sector <= last) && (sector < LPCISP_MAX_SECTORS); sector++){
+		m_erase_map[sector/32] |= (1<<(sector%32));
+	}
+}
+
+/*! \details This function checks whether flash from \a start to \a end
+ * matches the image in \a f. Flash outside the image segments
+ * must be blank. A single CRC is read from the target if the bootloader supports it,
+ * otherwise each page is uploaded to RAM and compared on the target.
+ * \return Zero if flash matches, 1 if it doesn't or -1 on error
+ */
+int LpcIsp::compare_image(File & f, u32 start, u32 end){
+	u8 * buffer;
+	u32 loc;
+	u32 offset;
+	u32 page_size;
+	u32 crc;
+	u32 target_crc;
+	bool is_crc;
+	int ret;
+
+	buffer = m_image.page_buffer();
+
+	is_crc = m_phy.is_read_crc();
+	crc = 0;
+	ret = 0;
+	for(loc = start; (ret == 0) && (loc < end); loc += page_size){
+		offset = loc % m_image.page_size();
+		page_size = m_image.page_size() - offset;
+		if( page_size > end - loc ){
+			page_size = end - loc;
+		}
+
+		if( m_image.read_page(f, loc / m_image.page_size(), buffer) < 0 ){
+			return -1;
+		}
+
+		if( is_crc ){
+			crc = crc32_calc(crc, buffer + offset, page_size);
+		} else if( (ret = m_phy.compare_flash(loc, buffer + offset, page_size)) < 0 ){
+			return -1;
+		}
+	}
+
+	if( is_crc ){
+		ret = m_phy.read_crc(start, end - start, &target_crc);
+		if( ret < 0 ){
+			return -1;
+		}
+
+		if( ret != 0 ){
+			if( m_phy.is_read_crc() == false ){
+				//the bootloader doesn't have the command after all
+				return compare_image(f, start, end);
 			}
+			return -1;
 		}
-		//delay_ms(2);
-		bytes_written+=page_size;
-	} while( bytes_written < (int)size );
 
-	return bytes_written;
+		isplib_debug(DEBUG_LEVEL+1, "CRC 0x%lX:%ld is 0x%lX (image 0x%lX)", start, end - start, target_crc, crc);
+		ret = (crc == target_crc) ? 0 : 1;
+	}
+
+	return ret;
 }
 
+/*! \details This function removes sectors from the erase map when flash
+ * already matches the image. Sector 0 is always rewritten because
+ * the vector checksum is patched into it and the boot ROM is mapped
+ * over its start.
+ * \return Zero on success
+ */
+int LpcIsp::plan_delta(File & f){
+	u32 sectors;
+	u32 sector;
+	u32 unchanged;
+	int ret;
+
+	sectors = lpc_device_get_sector_count(m_device);
+	if( (sectors == 0) || (m_erase_mode == ERASE_ALL) ){
+		status_printf("Delta programming isn't available--writing every sector");
+		return 0;
+	}
+
+	if( sectors > LPCISP_MAX_SECTORS ){
+		sectors = LPCISP_MAX_SECTORS;
+	}
+
+	unchanged = 0;
+	for(sector=1; sector < sectors; sector++){
+		if( is_erase_sector(sector) == false ){
+			continue;
+		}
 
+		if( (ret = compare_sector(f, sector)) < 0 ){
+			return -1;
+		}
+
+		if( ret == 0 ){
+			m_erase_map[sector/32] &= ~(1<<(sector%32));
+			unchanged++;
+		}
+	}
+
+	status_printf("%ld sectors are unchanged", unchanged);
+	return 0;
+}
+
+/*! \details This function erases the sectors in the erase map. Contiguous
+ * sectors are erased with a single command.
+ * \return Zero on success
+ */
 int LpcIsp::erase_dev(){
-	int sectors;
-	int ret;
+	u32 sectors;
+	u32 start;
+	u32 end;
 
-	//first see how many sectors there are
-	sectors = 0;
-	do {
-		ret = m_phy.prep_sector(0, sectors);
-		if ( !ret ){
-			sectors++;
+	if( m_erase_mode == ERASE_ALL ){
+		return erase_all();
+	}
+
+	if( lpc_device_get_sector_count(m_device) == 0 ){
+		//the sector layout isn't known for this device
+		return erase_all();
+	}
+
+	sectors = sector_count();
+	if( sectors > LPCISP_MAX_SECTORS ){
+		sectors = LPCISP_MAX_SECTORS;
+	}
+
+	for(start=0; start < sectors; start = end+1){
+		if( (m_erase_map[start/32] & (1<<(start%32))) == 0 ){
+			end = start;
+			continue;
 		}
-	} while ( !ret );
 
-	status_printf("Erase %d sectors", sectors);
-	//Now erase all the sectors
-	ret = m_phy.erase_sector(0, --sectors);
-	if ( ret != 0 ){
-		isplib_error("Failed to erase device");
+		for(end = start; end+1 < sectors; end++){
+			if( (m_erase_map[(end+1)/32] & (1<<((end+1)%32))) == 0 ){
+				break;
+			}
+		}
+
+		if( erase_sectors(start, end) < 0 ){
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int LpcIsp::erase_all(){
+	u32 sectors;
+
+	sectors = sector_count();
+	if( sectors == 0 ){
+		isplib_error("Failed to find the number of sectors");
 		return -1;
 	}
 
-	ret = m_phy.blank_check_sector(1, sectors);
-	if ( ret < 0 ){
-		isplib_error("Device not blank");
-		return ret;
+	return erase_sectors(0, sectors-1);
+}
+
+void LpcIsp::set_device(const char * dev){
+	if( (m_device == 0) || strcmp(m_device, dev) ){
+		m_sector_count = 0;
 	}
+	m_device = dev;
+}
 
-	return 0;
+/*! \details This function returns the number of flash sectors on the device.
+ * The count comes from the sector table in lpc_devices.c. Parts that aren't
+ * in the table are probed once and the result is kept until the device changes.
+ */
+u32 LpcIsp::sector_count(){
+	if( m_sector_count == 0 ){
+		m_sector_count = lpc_device_get_sector_count(m_device);
+		if( m_sector_count == 0 ){
+			m_sector_count = probe_sector_count();
+		}
+		isplib_debug(DEBUG_LEVEL, "Device has %ld sectors", m_sector_count);
+	}
+	return m_sector_count;
 }
 
-int LpcIsp::write_vector_checksum(unsigned char * hex_buffer, const char * dev){
-	u16 i;
-	int32_t addr;
-	u32 check;
-	u32 * hex32 = (u32*)hex_buffer;
+u32 LpcIsp::probe_sector_count(){
+	u32 sectors;
 
-	//Get the device specific checksum address
-	addr = lpc_device_get_checksum_addr(dev);
+	//prepare increasing ranges until the bootloader rejects the sector number
+	sectors = 0;
+	while( (sectors < LPCISP_MAX_SECTORS) && (m_phy.prep_sector(0, sectors) == 0) ){
+		sectors++;
+	}
 
-	if ( addr < 0 ){
-		m_trace.trace_error();
-		status_printf("Device %s not supported", dev);
+	return sectors;
+}
+
+/*! \details This function blank checks sectors \a start to \a end.
+ * \return The first sector that isn't blank, \a end + 1 if they are all blank or -1 on error
+ */
+int LpcIsp::find_dirty_sector(u32 start, u32 end){
+	u32 offset;
+	u32 sector;
+	int ret;
+
+	offset = 0;
+	ret = m_phy.blank_check_sector(start, end, &offset);
+	if( ret < 0 ){
 		return -1;
 	}
 
-	check = 0;
-	for(i=0; i < addr/4; i++){
-		check += hex32[i];
+	if( ret == 0 ){
+		return end+1;
 	}
 
-	check = (u32)(check*-1);
+	if( lpc_device_get_sector_count(m_device) == 0 ){
+		//can't map the offset to a sector
+		return start;
+	}
 
-	hex32[addr/4] = check;
+	//SECTOR_NOT_BLANK is followed by the byte offset of the first non-blank
+	//word from the start of the first sector checked (UM10360 "Blank check sector")
+	sector = lpc_device_get_sector_number(m_device, lpc_device_get_sector_addr(m_device, start) + offset);
+	if( (sector < start) || (sector > end) ){
+		return start;
+	}
+
+	return sector;
+}
+
+int LpcIsp::erase_sectors(u32 start, u32 end){
+	u32 first;
+	int dirty;
+
+	if( m_is_skip_blank == false ){
+		return erase_sector_range(start, end);
+	}
+
+	//First sector is mapped to the bootloader and won't blank check so it is always erased
+	first = (start == 0) ? 1 : start;
+	dirty = end+1;
+	if( first <= end ){
+		if( (dirty = find_dirty_sector(first, end)) < 0 ){
+			isplib_error("Failed to blank check sectors");
+			return -1;
+		}
+	}
+
+	if( start == 0 ){
+		if( dirty == 1 ){
+			return erase_sector_range(0, end);
+		}
+
+		if( erase_sector_range(0, 0) < 0 ){
+			return -1;
+		}
+	}
+
+	if( dirty > (int)end ){
+		if( first <= end ){
+			status_printf("Sectors %ld to %ld are blank", first, end);
+		}
+		return 0;
+	}
+
+	return erase_sector_range(dirty, end);
+}
+
+int LpcIsp::erase_sector_range(u32 start, u32 end){
+	u32 sector;
+	u32 size;
+	int ret;
+
+	//the erase timeout depends on how much is erased
+	size = 0;
+	for(sector = start; sector <= end; sector++){
+		size += lpc_device_get_sector_size(m_device, sector);
+	}
+
+	status_printf("Erase sectors %ld to %ld of %ld", start, end, sector_count());
+	ret = m_phy.prep_erase_sector(start, end, size);
+	if ( ret != 0 ){
+		isplib_error("Failed to erase device");
+		return -1;
+	}
+
+	//First sector is mapped to the bootloader and won't blank check
+	if( start == 0 ){
+		start = 1;
+	}
+
+	if( start <= end ){
+		ret = m_phy.blank_check_sector(start, end);
+		if ( ret < 0 ){
+			isplib_error("Device not blank");
+			return ret;
+		}
+	}
 
-	status_printf("Position %lX patched: checksum = 0x%08lX", addr, check);
 	return 0;
 }
 
@@ -448,6 +1376,36 @@ bool LpcIsp::update_progress(int progress, int max){
 	return false;
 }
 
+void LpcIsp::status_stats(){
+	const lpc_phy_stats_t & stats = m_phy.stats();
+	u32 msec = stats.data_usec / 1000;
+
+	status_printf("Sent %ld bytes in %ld ms (%ld bytes/s, %s)",
+			stats.data_bytes,
+			msec,
+			msec ? (stats.data_bytes * 1000UL / msec) : 0UL,
+			m_phy.is_encode_pipeline() ? "pipelined" : "line by line");
+	status_printf("Verified %ld bytes with %ld commands in %ld ms",
+			stats.verify_bytes,
+			stats.verify_commands,
+			stats.verify_usec / 1000);
+	status_printf("UART: %ld bytes in %ld writes (%s), %ld bytes read",
+			stats.tx_bytes,
+			stats.tx_writes,
+			m_phy.is_batch_write() ? "one per block" : "one per line",
+			stats.rx_bytes);
+	status_printf("Sent %ld commands ahead of a return code (%s)",
+			stats.window_commands,
+			m_phy.is_command_pair() ? "prepare pairs" : "one at a time");
+	if( m_phy.is_speculate() ){
+		status_printf("Sent %ld blocks ahead of a checksum response (%ld resent)",
+				stats.speculative_blocks,
+				stats.speculative_misses);
+	} else if( m_phy.is_speculate_rejected() ){
+		status_printf("Blocks were not sent ahead of checksum responses (not accepted or not available)");
+	}
+}
+
 bool LpcIsp::status_printf(const char * format, ...){
 	if( m_status_callback ){
 		char buffer[256];
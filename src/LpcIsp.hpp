@@ -22,6 +22,14 @@ limitations under the License.
 #include <sapi/sys.hpp>
 
 #include "LpcPhy.hpp"
+#include "LpcImage.hpp"
+
+#define LPCISP_MAX_SECTORS 128
+#define LPCISP_ERASE_SECTOR_MSEC 100 //typical sector erase time used for estimates
+#define LPCISP_WRITE_KB_MSEC 4 //typical time to copy 1KB from RAM to flash
+#define LPCISP_PAGE_OVERHEAD_BYTES 64 //command and response bytes for each page written
+#define LPCISP_PATH_SIZE 256
+#define LPCISP_HEX_BUFFER_SIZE 512 //Intel HEX records are written to the file in batches this size
 
 
 class LpcIsp {
@@ -32,10 +40,34 @@ public:
 		m_context = 0;
 		m_progress_callback = 0;
 		m_status_callback = 0;
+		m_erase_mode = ERASE_IMAGE;
+		m_is_skip_blank = false;
+		m_is_delta = false;
+		m_is_dry_run = false;
+		m_is_command_pair = true;
+		m_patch_callback = 0;
+		m_unit = 0;
+		m_image_path[0] = 0;
+		m_image_crc = 0;
+		m_plan_pages = 0;
+		m_plan_bytes = 0;
+		m_read_addr = 0;
+		m_read_size = 0;
+		m_device = 0;
+		m_sector_count = 0;
 	}
 
+	enum {
+		ERASE_IMAGE /*! Erase only the sectors the image overlaps (default) */,
+		ERASE_ALL /*! Erase every sector on the device */
+	};
+
 	int program(const char * filename, int crystal, const char * dev);
 	int read(const char * filename, int crystal, const char * dev);
+	/*! \details Prepares the image in \a filename for \a dev and saves it as an artifact (see lpc_artifact.h)
+	 * in \a path. program() sends the pages of an artifact as they are. No device is needed.
+	 */
+	int prepare(const char * filename, const char * dev, const char * path);
 	char ** getlist();
 
 	int copy_names(char * device, char * pio0, char * pio1);
@@ -43,6 +75,39 @@ public:
 	int exit_phy(){ return m_phy.exit(); }
 	int reset(){ return m_phy.reset(); }
 
+	/*! \details Sets the bit rates to try after sync (zero terminated, 0 to disable) */
+	void set_baud_ladder(const u32 * ladder){ m_phy.set_baud_ladder(ladder); }
+	/*! \details Encodes uuencode blocks on a separate thread while transmitting (default) */
+	void set_encode_pipeline(bool v = true){ m_phy.set_encode_pipeline(v); }
+	/*! \details Sets the verify policy (e.g. LpcPhy::VERIFY_SECTOR) */
+	void set_verify(u8 policy){ m_phy.set_verify(policy); }
+	void set_batch_write(bool value = true){ m_phy.set_batch_write(value); }
+	/*! \details Sends copy and erase right behind their prepare on parts that buffer them (default) */
+	void set_command_pair(bool value = true){ m_is_command_pair = value; }
+	/*! \details Sends full uuencode blocks before the previous checksum response arrives (checked on the device first) */
+	void set_speculate(bool value = true){ m_phy.set_speculate(value); }
+	/*! \details Sets which sectors program() erases (ERASE_IMAGE or ERASE_ALL) */
+	void set_erase_mode(u8 mode){ m_erase_mode = mode; }
+	/*! \details Blank checks each erase range first and only erases from the first sector that isn't blank */
+	void set_skip_blank(bool value = true){ m_is_skip_blank = value; }
+	/*! \details Only erases and writes sectors whose contents differ from the image (sector 0 is always written) */
+	void set_delta(bool value = true){ m_is_delta = value; }
+	/*! \details Stops program() after the write plan is made and reports how long programming would take */
+	void set_dry_run(bool value = true){ m_is_dry_run = value; }
+	/*! \details Sets the range read() copies to the file (\a size 0 reads to the end of flash).
+	 * With set_skip_blank(), read() skips blank sectors; a file ending in .hex is written as Intel HEX
+	 */
+	void set_read_range(u32 addr, u32 size){ m_read_addr = addr; m_read_size = size; }
+
+
+	/*! \details Adds bytes to write over the image at \a addr (e.g. a serial number or calibration data) */
+	int add_patch(u32 addr, const void * data, u32 size){ return m_image.add_patch(addr, data, size); }
+	void clear_patches(){ m_image.clear_patches(); }
+	int load_patches(const char * path);
+	/*! \details Sets a callback that adds the patches for each unit; program() clears the patches and
+	 * calls it with the unit number before programming (return true to abort)
+	 */
+	void set_patch_callback(bool (*patch)(void*, u32 unit)){ m_patch_callback = patch; }
 
 	void set_progress_callback(bool (*progress)(void*,int, int)){ m_progress_callback = progress; }
 	void set_status_callback(bool (*status)(void*, const char * message)){ m_status_callback = status; }
@@ -52,16 +117,50 @@ private:
 
 	bool update_progress(int progress, int max);
 	bool status_printf(const char * format, ...);
+	void status_stats();
 
 	bool (*m_progress_callback)(void*, int, int);
 	bool (*m_status_callback)(void*, const char * message);
+	bool (*m_patch_callback)(void*, u32 unit);
 	void * m_context;
 
 	LpcPhy m_phy;
 	const char * m_device;
+	u32 m_sector_count; //0 until sector_count() looks it up
+	void set_device(const char * dev);
+	u32 sector_count();
+	u32 probe_sector_count();
 	int init_prog_interface(int crystal);
+	u8 m_erase_mode;
+	bool m_is_skip_blank;
+	bool m_is_delta;
+	bool m_is_dry_run;
+	bool m_is_command_pair;
+	u32 m_read_addr;
+	u32 m_read_size;
+	u32 m_erase_map[LPCISP_MAX_SECTORS/32]; //sectors the image overlaps
+	void plan_erase();
+	void plan_erase_range(u32 addr, u32 size);
+	int plan_delta(File & f);
+	int compare_image(File & f, u32 start, u32 end);
+	int compare_sector(File & f, u32 sector);
+	LpcImage m_image;
+	char m_image_path[LPCISP_PATH_SIZE]; //file m_image was loaded from
+	uint32_t m_image_crc; //CRC32 of that file when it was loaded
+	u32 m_unit; //number of times program() has run
+	u32 m_plan_pages; //pages program() writes
+	u32 m_plan_bytes; //bytes program() writes
+	void plan_writes();
+	bool is_write_page(u32 page) const;
+	u32 estimate_msec() const;
+	bool is_erase_sector(u32 sector) const {
+		return (sector < LPCISP_MAX_SECTORS) && (m_erase_map[sector/32] & (1<<(sector%32)));
+	}
 	int erase_dev();
-	u32 write_progmem(void * data, u32 addr, u32 size, bool (*progress)(void*,int, int), void * context);
+	int erase_all();
+	int erase_sectors(u32 start, u32 end);
+	int erase_sector_range(u32 start, u32 end);
+	int find_dirty_sector(u32 start, u32 end);
 	u32 read_progmem(void * data, u32 addr, u32 size, bool (*progress)(void*,int, int), void * context);
 	u16 verify_progmem(
 			void * data,
@@ -70,7 +169,11 @@ private:
 			u32 size,
 			int (*progress)(int, int), void * context);
 
-	int write_vector_checksum(unsigned char * hex_buffer, const char * dev);
+	int verify_image(File & f);
+	int write_hex(File & f, u32 addr, const char * data, u32 size, u32 * hex_base);
+	int write_artifact(File & f, File & out, const lpc_artifact_header_t & header);
+	u32 encode_page(char * dest, const u8 * src, u32 copy_size);
+	int check_artifact();
 	int prog_shutdown();
 
 	Trace m_trace;
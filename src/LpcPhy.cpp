@@ -26,6 +26,10 @@ limitations under the License.
 #define DEBUG_LEVEL 3
 
 #include <unistd.h>
+#include <errno.h>
+#if !defined __link
+#include <poll.h>
+#endif
 
 static const char * uart_speeds[] = {
 		"115200",
@@ -37,6 +41,13 @@ static const char * uart_speeds[] = {
 		NULL
 };
 
+static const u32 baud_ladder[] = {
+		230400,
+		460800,
+		921600,
+		0
+};
+
 enum {
 	LPC_ISP_RET_CMD_SUCCESS,
 	LPC_ISP_RET_INVALID_COMMAND,
@@ -46,7 +57,7 @@ enum {
 	LPC_ISP_RET_DST_ADDR_NOT_MAPPED,
 	LPC_ISP_RET_COUNT_ERROR,
 	LPC_ISP_RET_RET7,
-	LPC_ISP_RET_RET8,
+	LPC_ISP_RET_SECTOR_NOT_BLANK,
 	LPC_ISP_RET_RET9,
 	LPC_ISP_RET_COMPARE_ERROR,
 	LPC_ISP_RET_BUSY,
@@ -148,9 +159,10 @@ int LpcPhy::open(int crystal){
 	int id;
 	int version;
 	int err;
-	uart_attr_t attr;
 	int count;
 
+	m_speculate = SPECULATE_UNKNOWN;
+
 	if ( m_reset.set() < 0 ){
 		isplib_error("Failed to set reset\n");
 		m_trace.assign("Set Reset");
@@ -165,19 +177,19 @@ int LpcPhy::open(int crystal){
 		return -2;
 	}
 
-	m_pin_assignment.copy(attr.pin_assignment);
-	attr.o_flags = Uart::FLAG_IS_PARITY_NONE | Uart::FLAG_IS_STOP1;
-	attr.width = 8;
+	m_pin_assignment.copy(m_uart_attr.pin_assignment);
+	m_uart_attr.o_flags = Uart::FLAG_IS_PARITY_NONE | Uart::FLAG_IS_STOP1;
+	m_uart_attr.width = 8;
 
 	for(i=m_max_speed; uart_speeds[i] != NULL; i++){
 
-		attr.freq = atoi(uart_speeds[i]);
-		m_trace.sprintf("Try Sync %ld", attr.freq);
+		m_uart_attr.freq = atoi(uart_speeds[i]);
+		m_trace.sprintf("Try Sync %ld", m_uart_attr.freq);
 		m_trace.trace_message();
 
-		if ( m_uart.set_attr(attr) < 0 ){
+		if ( m_uart.set_attr(m_uart_attr) < 0 ){
 			isplib_error("Failed to set baud rate\n");
-			m_trace.sprintf("Set Baud rate %ld", attr.freq);
+			m_trace.sprintf("Set Baud rate %ld", m_uart_attr.freq);
 			m_trace.trace_error();
 			return -4;
 		}
@@ -231,12 +243,21 @@ int LpcPhy::open(int crystal){
 				}
 
 				version = this->read_boot_version();
+				m_boot_version = version;
 				if( version ){
 					isplib_debug(DEBUG_LEVEL, "Bootloader Version is %d.%d\n", (version>>8)&0xFF, version&0xFF);
 					m_trace.sprintf( "Boot version:%d", version);
 					m_trace.trace_message();
 				}
 
+				if( m_baud_ladder && (escalate_baud_rate(crystal, id) < 0) ){
+					//the link was lost while changing speed--sync again at a safe rate only
+					const u32 * ladder = m_baud_ladder;
+					m_baud_ladder = 0;
+					err = this->open(crystal);
+					m_baud_ladder = ladder;
+					return err;
+				}
 
 				return 0;
 			} else {
@@ -261,6 +282,7 @@ int LpcPhy::close(){
 int LpcPhy::flush(){
 	char buf[64];
 	while( m_uart.read(buf, 64) > 0 ){}
+	clear_rx_buffer();
 	return m_uart.flush();
 }
 
@@ -276,71 +298,141 @@ void LpcPhy::set_ram_buffer(u32 addr){
 
 
 /*! \brief writes a block to the flash memory.
- * \details This function writes to the flash memory.
+ * \details This function writes to the flash memory. Each page (up to
+ * ram_buffer_size() bytes) is uploaded to target RAM in one or more chunks then
+ * written with a single prepare and copy. It is verified according to set_verify().
  * \return Number of bytes written
  */
 int LpcPhy::write_memory(u32 loc, const void * buf, int nbyte, u32 sector){
-	char page_buffer[LPCPHY_RAM_BUFFER_SIZE];
+	int ret;
+
+	ret = write_pages(loc, (const char*)buf, nbyte, sector);
+
+	//blocks from set_encoded() are only good for one call
+	m_encoded = 0;
+	m_encoded_size = 0;
+	return ret;
+}
+
+/*! \details Writes pages with the ISP write to RAM, prepare and copy commands (see write_memory()). */
+int LpcPhy::write_pages(u32 loc, const char * src_data, int nbyte, u32 sector){
 	u32 bytes_written;
-	const char * src_data = (const char*)buf;
-	u16 page_size;
-	char err;
-	int retry;
+	u32 page_size;
+	u32 copy_size;
+	u32 ram_addr;
+
+	if( m_is_speculate && (m_speculate == SPECULATE_UNKNOWN) && (start_speculate() < 0) ){
+		return 0;
+	}
+
 	bytes_written = 0;
 	do {
 
-		if ( nbyte - bytes_written < LPCPHY_RAM_BUFFER_SIZE ){
+		if ( nbyte - bytes_written < m_ram_buffer_size ){
 			page_size = nbyte-bytes_written;
 		} else {
-			page_size = LPCPHY_RAM_BUFFER_SIZE;
+			page_size = m_ram_buffer_size;
+		}
+		copy_size = calc_copy_size(page_size);
+
+		if( m_verify == VERIFY_SECTOR ){
+			//verify what is in the window if this page can't be added to it
+			if( m_verify_size &&
+					((sector != m_verify_sector) ||
+							(loc != m_verify_flash + m_verify_size) ||
+							(m_verify_size + copy_size > m_ram_window_size)) ){
+				if( verify_flush() < 0 ){
+					return 0;
+				}
+			}
+			ram_addr = m_ram_buffer + m_verify_size;
+		} else {
+			//the next write to RAM waits for the copy, so the page can be retried from the same RAM
+			ram_addr = m_ram_buffer;
 		}
 
-		memset(page_buffer, 0xFF, LPCPHY_RAM_BUFFER_SIZE);
-		memcpy(page_buffer, src_data + bytes_written, page_size);
+		//encode the start of this page while the previous copy to flash completes
+		if( (m_encoded_size == 0) && is_uuencode() && is_encode_pipeline() && (page_size >= LPCPHY_RAM_BUFFER_SIZE) ){
+			m_encode_pipeline.start(src_data + bytes_written, calc_chunk_size(page_size, copy_size));
+		}
 
-		retry = 0;
-		do {
-			//first copy the data to RAM
-			if ( this->write_ram(m_ram_buffer, page_buffer, LPCPHY_RAM_BUFFER_SIZE) ){
-				retry++;
-				Timer::wait_msec(100);
-			} else {
-				break;
-			}
+		if( complete_copy() < 0 ){
+			m_encode_pipeline.finish();
+			return 0;
+		}
 
-		} while( retry < 3 );
+		if( write_ram_page(ram_addr, src_data + bytes_written, page_size, copy_size) < 0 ){
+			return 0;
+		}
 
-		if( retry == 3 ){
-			printf("Failed to write RAM 0x%lX\n", m_ram_buffer);
-			snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to write RAM");
-			m_trace.trace_error();
+		//the return codes are read just before the next command (see complete_copy())
+		if( start_copy(loc, ram_addr, copy_size, sector) < 0 ){
 			return 0;
 		}
 
-		retry = 0;
-		do {
-			//Prepare the target sector
-			if ( (err = this->prep_sector(sector, sector)) ){
-				retry++;
-				Timer::wait_msec(100);
-			} else {
-				break;
+		if ( sector && (m_verify == VERIFY_SECTOR) ){ //First sector is mapped to the bootloader and won't compare properly
+			if( m_verify_size == 0 ){
+				m_verify_flash = loc;
+				m_verify_ram = ram_addr;
+				m_verify_sector = sector;
 			}
+			m_verify_size += copy_size;
+		}
 
-		} while( retry < 3 );
+		loc += page_size;
+		bytes_written += page_size;
+	} while ( (int)bytes_written < nbyte );
 
-		if( retry == 3 ){
-			printf("Failed to prepare sector (%d)", err);
-			snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to prepare %d", err);
-			m_trace.trace_error();
-			return 0;
+	m_trace.sprintf("Wrote %ld bytes", bytes_written);
+	m_trace.trace_message();
+
+	return bytes_written;
+
+}
+
+/*! \details This function uploads a page to target RAM in chunks of
+ * LPCPHY_RAM_BUFFER_SIZE bytes. Bytes past \a page_size (up to \a copy_size)
+ * are filled with 0xFF.
+ * \return Zero on success
+ */
+int LpcPhy::write_ram_page(u32 ram_addr, const char * src, u32 page_size, u32 copy_size){
+	char page_buffer[LPCPHY_RAM_BUFFER_SIZE];
+	const char * chunk;
+	const char * encoded;
+	u32 encoded_size;
+	u32 chunk_size;
+	u32 max_chunk_size;
+	u32 offset;
+	int retry;
+
+	max_chunk_size = calc_chunk_size(page_size, copy_size);
+	for(offset=0; offset < copy_size; offset += chunk_size){
+		if( copy_size - offset > max_chunk_size ){
+			chunk_size = max_chunk_size;
+		} else {
+			chunk_size = copy_size - offset;
+		}
+
+		if( offset + chunk_size <= page_size ){
+			chunk = src + offset;
+		} else {
+			//the last chunk is padded
+			memset(page_buffer, 0xFF, chunk_size);
+			if( offset < page_size ){
+				memcpy(page_buffer, src + offset, page_size - offset);
+			}
+			chunk = page_buffer;
 		}
 
+		//a failed write resends the chunk from its first encoded block
+		encoded = m_encoded;
+		encoded_size = m_encoded_size;
 		retry = 0;
 		do {
-			//copy from RAM to flash
-			if ( this->copy_ram_to_flash(loc, m_ram_buffer, LPCPHY_RAM_BUFFER_SIZE) ){
+			if ( this->write_ram(ram_addr + offset, (void*)chunk, chunk_size) ){
 				retry++;
+				m_encoded = encoded;
+				m_encoded_size = encoded_size;
 				Timer::wait_msec(100);
 			} else {
 				break;
@@ -349,89 +441,263 @@ int LpcPhy::write_memory(u32 loc, const void * buf, int nbyte, u32 sector){
 		} while( retry < 3 );
 
 		if( retry == 3 ){
-			printf("Failed to copy RAM to flash\n");
-			snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to copy %d", LPCPHY_RAM_BUFFER_SIZE);
+			printf("Failed to write RAM 0x%lX\n", ram_addr + offset);
+			snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to write RAM");
 			m_trace.trace_error();
-			return 0;
+			return -1;
 		}
+	}
 
+	return 0;
+}
 
+/*! \details Returns the bytes sent with each write to RAM command for a page.
+ * Blocks are only sent ahead (see set_speculate()) within one write, so a
+ * full page is sent with one command when speculating.
+ */
+u32 LpcPhy::calc_chunk_size(u32 page_size, u32 copy_size) const {
+	if( is_speculate() && (m_encoded_size == 0) && (copy_size <= page_size) ){
+		return copy_size;
+	}
+	return LPCPHY_RAM_BUFFER_SIZE;
+}
 
-		retry = 0;
-		do {
+/*! \details Returns the smallest copy size that holds \a page_size bytes
+ * so a short last page isn't padded to a full RAM buffer.
+ */
+u32 LpcPhy::calc_copy_size(u32 page_size) const {
+	u32 copy_size;
+	copy_size = 256;
+	while( (copy_size < page_size) && (copy_size < m_ram_buffer_size) ){
+		copy_size = (copy_size == 1024) ? 4096 : copy_size*2;
+	}
+	if( copy_size > m_ram_buffer_size ){
+		copy_size = m_ram_buffer_size;
+	}
+	return copy_size;
+}
 
-			//Copy to RAM again, then compare the RAM to the flash
-			if ( this->write_ram(m_ram_buffer, page_buffer, LPCPHY_RAM_BUFFER_SIZE) ){
-				Timer::wait_msec(100);
-				retry++;
-			} else {
-				break;
-			}
+/*! \details This function sends the prepare and copy RAM to flash commands
+ * back to back without waiting for the return codes. The host can then do
+ * other work (reading and encoding the next page) while the target programs flash.
+ * \return Zero if the commands were sent
+ */
+int LpcPhy::start_copy(u32 flash_addr, u32 ram_addr, u32 size, u32 sector){
+	char buf[LPCPHY_COMMAND_SIZE];
 
-		} while( retry < 3 );
+	if( complete_copy() < 0 ){
+		return -1;
+	}
 
-		if( retry == 3 ){
-			printf("Failed to write RAM second time\n");
-			snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to re-write %d", LPCPHY_RAM_BUFFER_SIZE);
-			m_trace.trace_error();
-			return 0;
+	sprintf(buf, "P %d %d", (int)sector, (int)sector);
+	if( issue_command(buf, QUICK_TIMEOUT) < 0 ){
+		isplib_error("Failed to prep sector %ld\n", sector);
+		return -1;
+	}
+
+	sprintf(buf, "C %d %d %d", (int)flash_addr, (int)ram_addr, (int)size);
+	if( issue_command(buf, QUICK_TIMEOUT) < 0 ){
+		isplib_error("Failed to copy ram to flash %ld %ld %ld\n", flash_addr, ram_addr, size);
+		return -1;
+	}
+
+	m_copy_loc = flash_addr;
+	m_copy_ram = ram_addr;
+	m_copy_size = size;
+	m_copy_sector = sector;
+	m_is_copy_pending = true;
+	return 0;
+}
+
+/*! \details This function reads the return codes of the prepare and copy
+ * sent by start_copy(). The page is still in target RAM, so if either
+ * failed, the copy is rolled back to the prepare: the sector is prepared and
+ * copied again without uploading the page. The page is then
+ * verified if the policy is VERIFY_PAGE.
+ *
+ * \return Zero on success or if no copy is pending
+ */
+int LpcPhy::complete_copy(){
+	int ret;
+	int retry;
+
+	if( m_is_copy_pending == false ){
+		return 0;
+	}
+	m_is_copy_pending = false;
+
+	ret = drain_commands();
+	retry = 0;
+	while( (ret != 0) && (retry < 3) ){
+		retry++;
+		Timer::wait_msec(100);
+		if( (ret = this->prep_sector(m_copy_sector, m_copy_sector)) == 0 ){
+			ret = this->copy_ram_to_flash(m_copy_loc, m_copy_ram, m_copy_size);
 		}
+	}
 
-		if ( sector ){ //First sector is mapped to the bootloader and won't compare properly
+	if( ret != 0 ){
+		printf("Failed to copy RAM to flash\n");
+		snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to copy %ld", m_copy_size);
+		m_trace.trace_error();
+		m_is_copy_failed = true;
+		return -1;
+	}
 
-			//Now compare the ram to the flash to see if the operation was successful
-			retry = 0;
-			do {
-				if ( this->compare_memory(m_ram_buffer, loc, LPCPHY_RAM_BUFFER_SIZE) ){
-					retry++;
-					Timer::wait_msec(100);
-				} else {
-					break;
-				}
+	//First sector is mapped to the bootloader and won't compare properly
+	if( m_copy_sector && (m_verify == VERIFY_PAGE) ){
+		//The copy leaves RAM untouched so the page can be compared without uploading it again
+		m_verify_flash = m_copy_loc;
+		m_verify_ram = m_copy_ram;
+		m_verify_size = m_copy_size;
+		m_verify_sector = m_copy_sector;
+		return verify_flush();
+	}
 
-			} while( retry < 3 );
+	return 0;
+}
 
-			if( retry == 3 ){
-				printf("Write to compare memory\n");
-				snprintf(m_trace.cdata(), m_trace.capacity(), "Failed to compare\n");
-				m_trace.trace_error();
-				//isplib_debug(4, "Dumping RAM\n");
-				//debug_dump_mem(4, page_buffer, LPCPHY_RAM_BUFFER_SIZE);
-				//this->read_flash(page_buffer, addr, LPCPHY_RAM_BUFFER_SIZE);
-				//isplib_debug(4, "Dumping FLASH\n");
-				//debug_dump_mem(4, page_buffer, LPCPHY_RAM_BUFFER_SIZE);
-				return 0;
-			}
+/*! \details This function completes the last copy to flash and compares the
+ * flash pages that are still held in target RAM (see set_verify()) with the RAM copy.
+ * \return Zero on success (or if nothing is waiting to be verified)
+ */
+int LpcPhy::verify_flush(){
+	Timer timer;
+	int retry;
+
+	if( (complete_copy() < 0) || m_is_copy_failed ){
+		m_is_copy_failed = false;
+		return -1;
+	}
+
+	if( m_verify_size == 0 ){
+		return 0;
+	}
 
+	timer.start();
+	retry = 0;
+	do {
+		m_stats.verify_commands++;
+		if ( this->compare_memory(m_verify_ram, m_verify_flash, m_verify_size) ){
+			retry++;
+			Timer::wait_msec(100);
+		} else {
+			break;
 		}
 
+	} while( retry < 3 );
+	timer.stop();
 
-		loc += page_size;
-		bytes_written += page_size;
-	} while ( (int)bytes_written < nbyte );
+	m_stats.verify_usec += timer.calc_usec();
+	m_stats.verify_bytes += m_verify_size;
+	m_verify_size = 0;
 
-	m_trace.sprintf("Wrote %ld bytes", bytes_written);
-	m_trace.trace_message();
+	if( retry == 3 ){
+		printf("Failed to compare memory at 0x%lX\n", m_verify_flash);
+		m_trace.sprintf("Failed to compare 0x%lX", m_verify_flash);
+		m_trace.trace_error();
+		return -1;
+	}
 
-	return bytes_written;
+	return 0;
+}
+
+/*! \details This function checks if flash already holds \a buf by
+ * uploading it to target RAM one page at a time and comparing
+ * on the target (only the "W" traffic crosses the link).
+ * \return Zero if flash matches, 1 if it doesn't or -1 on error
+ */
+int LpcPhy::compare_flash(u32 loc, const void * buf, int nbyte){
+	int bytes_compared;
+	int page_size;
+	u32 copy_size;
+	int ret;
+
+	bytes_compared = 0;
+	do {
+		if ( nbyte - bytes_compared < (int)m_ram_buffer_size ){
+			page_size = nbyte - bytes_compared;
+		} else {
+			page_size = m_ram_buffer_size;
+		}
 
+		//the compare size must be a multiple of 4
+		copy_size = (page_size + 3) & ~0x03;
+
+		if( write_ram_page(m_ram_buffer, (const char*)buf + bytes_compared, page_size, copy_size) < 0 ){
+			return -1;
+		}
+
+		m_stats.verify_commands++;
+		ret = compare_memory(loc + bytes_compared, m_ram_buffer, copy_size);
+		if( ret < 0 ){
+			return -1;
+		}
+
+		if( ret != 0 ){
+			return 1;
+		}
+
+		bytes_compared += page_size;
+	} while( bytes_compared < nbyte );
+
+	m_stats.verify_bytes += bytes_compared;
+	return 0;
+}
+
+/*! \details This function reads flash back and compares it to \a buf.
+ * \return Zero if the flash matches
+ */
+int LpcPhy::verify_memory(u32 loc, const void * buf, int nbyte){
+	char page_buffer[LPCPHY_RAM_BUFFER_SIZE];
+	Timer timer;
+	int bytes_verified;
+	int page_size;
+	int ret;
+
+	ret = 0;
+	bytes_verified = 0;
+	timer.start();
+	do {
+		if ( nbyte - bytes_verified < LPCPHY_RAM_BUFFER_SIZE ){
+			page_size = nbyte - bytes_verified;
+		} else {
+			page_size = LPCPHY_RAM_BUFFER_SIZE;
+		}
+
+		m_stats.verify_commands++;
+		if( (read_memory(loc + bytes_verified, page_buffer, (page_size + 3) & ~0x03) <= 0) ||
+				memcmp(page_buffer, (const char*)buf + bytes_verified, page_size) ){
+			m_trace.sprintf("Failed to verify 0x%lX", loc + bytes_verified);
+			m_trace.trace_error();
+			ret = -1;
+			break;
+		}
+
+		bytes_verified += page_size;
+	} while( bytes_verified < nbyte );
+	timer.stop();
+
+	m_stats.verify_usec += timer.calc_usec();
+	m_stats.verify_bytes += bytes_verified;
+	return ret;
 }
 
 
 
 int LpcPhy::read_memory(u32 loc, void * buf, int nbyte){
 	int bytes_read;
-	u16 page_size;
-	u16 max_page_size;
+	int page_size;
+	int max_page_size;
 	bytes_read = 0;
-	max_page_size = LPCPHY_RAM_BUFFER_SIZE;
+	max_page_size = LPCPHY_READ_SIZE;
 	do {
 		if ( nbyte - bytes_read < max_page_size ){
 			page_size = nbyte-bytes_read;
 		} else {
 			page_size = max_page_size;
 		}
-		if ( this->read_mem(&((char*)buf)[bytes_read], loc + bytes_read, page_size) != page_size ){
+		if ( this->read_mem(&((char*)buf)[bytes_read], loc + bytes_read, page_size) != (u32)page_size ){
 			printf("Failed to read memory (%lX)\n", loc + bytes_read);
 			return 0;
 		}
@@ -546,7 +812,7 @@ int LpcPhy::sync_bootloader(u32 crystal /*! Crystal frequency in KHz */){
 
 	isplib_debug(DEBUG_LEVEL+1, "Sending ?\n");
 	sprintf(buf, "?");
-	bytes = m_uart.write(buf, strlen(buf));
+	bytes = uart_write(buf, strlen(buf));
 	if ( bytes != strlen(buf) ){
 		isplib_error("failed to write ? (%d, %d)\n", bytes, link_errno);
 		m_trace.assign("Write ?");
@@ -569,7 +835,7 @@ int LpcPhy::sync_bootloader(u32 crystal /*! Crystal frequency in KHz */){
 	//send "Synchronized<CR><LF>"
 	isplib_debug(DEBUG_LEVEL+1, "Sending 'Synchronized'\n");
 	sprintf(buf, "Synchronized\r\n");
-	bytes = m_uart.write(buf, strlen(buf));
+	bytes = uart_write(buf, strlen(buf));
 	if ( bytes != strlen(buf) ){
 		isplib_error("failed to write synchronized\n");
 		m_trace.assign("Send Synchronized");
@@ -589,7 +855,8 @@ int LpcPhy::sync_bootloader(u32 crystal /*! Crystal frequency in KHz */){
 	m_trace.assign("Sync OK");
 	m_trace.trace_message();
 
-	if( m_uart.read(&c,1) ){
+	fill_rx_buffer();
+	if( read_rx_buffer(&c, 1) ){
 		if( c == '\n' ){
 			Timer::wait_msec(10);
 			m_trace.assign("Set return code newline");
@@ -604,7 +871,7 @@ int LpcPhy::sync_bootloader(u32 crystal /*! Crystal frequency in KHz */){
 			//send crystal freq
 			isplib_debug(DEBUG_LEVEL+1, "Sending Crystal Value\n");
 			sprintf(buf, "%d\r\n", (int)crystal);
-			bytes = m_uart.write(buf, strlen(buf));
+			bytes = uart_write(buf, strlen(buf));
 			if ( bytes != strlen(buf) ){
 				isplib_error("failed to write crystal value\n");
 				return -1;
@@ -641,7 +908,7 @@ int LpcPhy::sync_bootloader(u32 crystal /*! Crystal frequency in KHz */){
 			//send crystal freq
 			isplib_debug(DEBUG_LEVEL+1, "Sending Crystal Value\n");
 			sprintf(buf, "%d\r\n", (int)crystal);
-			bytes = m_uart.write(buf, strlen(buf));
+			bytes = uart_write(buf, strlen(buf));
 			if ( bytes != strlen(buf) ){
 				isplib_error("failed to write crystal value\n");
 				return -1;
@@ -742,6 +1009,9 @@ int LpcPhy::write_ram(u32 ram_dest /*! The RAM destination address--must be a wo
 		u32 size /*! The number of bytes to write--must be a multiple of 4 */){
 	char buf[64];
 	u32 bytes_written;
+	u32 repair_map;
+	u32 offset;
+	u32 i;
 	int ret;
 	isplib_debug(DEBUG_LEVEL+1, "wr ram 0x%X %d\n", ram_dest, size);
 
@@ -753,11 +1023,26 @@ int LpcPhy::write_ram(u32 ram_dest /*! The RAM destination address--must be a wo
 
 
 	if ( ret == 0 ){
+		m_repair_map = 0;
 		bytes_written = write_data(src, size);
 		if ( bytes_written != size ){
 			isplib_error("failed to write ram %d != %d\n", bytes_written, size);
 			return -1;
 		}
+
+		//blocks that landed in place of a resent block (see write_data_speculative())
+		repair_map = m_repair_map;
+		for(i=0; repair_map; i++){
+			if( (repair_map & (1<<i)) == 0 ){
+				continue;
+			}
+			repair_map &= ~(1<<i);
+			offset = i*UU_BLOCK_BYTES;
+			bytes_written = size - offset < UU_BLOCK_BYTES ? size - offset : UU_BLOCK_BYTES;
+			if( write_ram(ram_dest + offset, (char*)src + offset, bytes_written) != 0 ){
+				return -1;
+			}
+		}
 	}
 
 	return ret;
@@ -782,8 +1067,9 @@ u32 LpcPhy::read_mem(void * dest /*! A pointer to the destination memory */,
 		return -1;
 	}
 
-	printf("Read 0x%lX %ld\n", src_addr, size);
+	isplib_debug(DEBUG_LEVEL+1, "Read 0x%lX %ld\n", src_addr, size);
 	snprintf(buf, 63, "R %d %d", (int)src_addr, (int)size);
+	clear_rx_buffer();
 	m_uart.flush();
 
 	if( (ret = send_command(buf, QUICK_TIMEOUT)) < 0 ){
@@ -803,9 +1089,7 @@ u32 LpcPhy::read_mem(void * dest /*! A pointer to the destination memory */,
 		return 0;
 	}
 
-	bytes_read = size;
-	printf("Read-- %ld bytes\n", bytes_read);
-	return bytes_read;
+	return size;
 }
 
 /*! \details This function ares the specified sectors for writing.  The sector
@@ -874,12 +1158,13 @@ int LpcPhy::go(u32 addr /*! Where to start code execution */,
  * \sa LpcPhy::prep_sector()
  */
 int LpcPhy::erase_sector(u32 start /*! The first sector to erase */,
-		u32 end /*! The last sector to erase--must be >= start */){
+		u32 end /*! The last sector to erase--must be >= start */,
+		u32 size /*! Bytes in the sectors (0 if not known) */){
 	char buf[64];
-	u16 ret;
+	int ret;
 	isplib_debug(DEBUG_LEVEL+1, "erase sector\n");
 	sprintf(buf, "E %d %d", (int)start, (int)end);
-	if( (ret = send_command(buf, TIMEOUT, 150)) < 0 ){
+	if( (ret = send_command(buf, calc_erase_timeout(end - start + 1, size))) < 0 ){
 		isplib_error("Failed to erase sector %d %d\n", start, end);
 		return -1;
 	}
@@ -887,13 +1172,74 @@ int LpcPhy::erase_sector(u32 start /*! The first sector to erase */,
 
 }
 
-/*! \details This function checks if the specified sectors are blank.
- * \return Zero if sectors are blank
+/*! \details The return code of an erase arrives when the last sector is
+ * erased. The wait allows twice the datasheet erase time for the sectors and
+ * their size on top of the usual response time.
+ * \return Milliseconds to wait
+ */
+u16 LpcPhy::calc_erase_timeout(u32 sectors, u32 size){
+	u32 msec;
+
+	msec = TIMEOUT + 2*(sectors * LPCPHY_ERASE_SECTOR_MSEC + (size / 1024) * LPCPHY_ERASE_KB_MSEC);
+	if( msec > 0xFFFF ){
+		return 0xFFFF;
+	}
+	return msec;
+}
+
+/*! \details This function sends the prepare and erase commands back to back
+ * (see set_command_pair()). If either fails, both are sent again.
+ * \return Zero on success or an LPC return code
+ */
+int LpcPhy::prep_erase_sector(u32 start /*! The first sector to erase */,
+		u32 end /*! The last sector to erase--must be >= start */,
+		u32 size /*! Bytes in the sectors (0 if not known) */){
+	char buf[LPCPHY_COMMAND_SIZE];
+	u8 failed;
+	int retry;
+	int ret;
+
+	if( complete_copy() < 0 ){
+		return -1;
+	}
+
+	retry = 0;
+	do {
+		sprintf(buf, "P %d %d", (int)start, (int)end);
+		if( issue_command(buf, QUICK_TIMEOUT) < 0 ){
+			drain_commands();
+			return -1;
+		}
+
+		sprintf(buf, "E %d %d", (int)start, (int)end);
+		if( issue_command(buf, calc_erase_timeout(end - start + 1, size)) < 0 ){
+			drain_commands();
+			return -1;
+		}
+
+		ret = drain_commands(&failed);
+		if( ret == 0 ){
+			break;
+		}
+
+		isplib_debug(DEBUG_LEVEL, "%s failed (%d)\n", failed ? "Erase" : "Prepare", ret);
+		retry++;
+		Timer::wait_msec(100);
+	} while( (ret > 0) && (retry < 3) );
+
+	return ret;
+}
+
+/*! \details This function checks if the specified sectors are blank using the "I" command.
+ * \return Zero if the sectors are blank, an LPC return code or -1 on error.
+ * If a sector isn't blank, \a offset is set to the byte offset of the first
+ * non-blank word from the start of sector \a start.
  */
 int LpcPhy::blank_check_sector(u32 start /*! The first sector to blank check */,
-		u32 end /*! The last sector to blank check--must be >= start */){
+		u32 end /*! The last sector to blank check--must be >= start */,
+		u32 * offset /*! Where to store the first non-blank offset (can be null) */){
 	char buf[LPCPHY_RAM_BUFFER_SIZE];
-	u16 ret;
+	int ret;
 	isplib_debug(DEBUG_LEVEL+1, "blank check\n");
 	sprintf(buf, "I %d %d", (int)start, (int)end);
 	if( (ret = send_command(buf, TIMEOUT)) < 0 ){
@@ -901,47 +1247,197 @@ int LpcPhy::blank_check_sector(u32 start /*! The first sector to blank check */,
 		return -1;
 	}
 
-	if ( ret != 0 ){
-		while( get_line(buf, LPCPHY_RAM_BUFFER_SIZE, QUICK_TIMEOUT) ){
-			Timer::wait_msec(100);
-			isplib_debug(DEBUG_LEVEL+1, "Sector not blank %s\n", buf);
+	if( ret == LPC_ISP_RET_SECTOR_NOT_BLANK ){
+		//the bootloader follows up with the offset and contents of the first non-blank word
+		if( get_line(buf, LPCPHY_RAM_BUFFER_SIZE, QUICK_TIMEOUT) > 0 ){
+			isplib_debug(DEBUG_LEVEL+1, "Sector not blank at %s\n", buf);
+			if( offset ){
+				*offset = strtoul(buf, 0, 10);
+			}
+			get_line(buf, LPCPHY_RAM_BUFFER_SIZE, QUICK_TIMEOUT);
+		} else {
+			return -1;
 		}
 	}
 
 	return ret;
 }
 
-/*! \brief reads the part ID.
- * \details This function reads the part ID.
- * \return The part ID value
+/*! \brief changes the bit rate of the bootloader.
+ * \details This function sends the "B" command. If the bootloader accepts
+ * the new rate, the UART is switched to match.
+ * \return Zero on success or an LPC return code
  */
-u32 LpcPhy::read_part_id(){
+int LpcPhy::set_baud_rate(u32 baud /*! The new bit rate for the bootloader and the UART */,
+		u8 stop_bits /*! Number of stop bits (1 or 2) */){
 	char buf[64];
 	int ret;
-	isplib_debug(DEBUG_LEVEL+1, "read part id\n");
-	sprintf(buf, "J");
+	isplib_debug(DEBUG_LEVEL+1, "set baud rate\n");
+	sprintf(buf, "B %ld %d", baud, stop_bits);
 	if( (ret = send_command(buf, QUICK_TIMEOUT)) < 0 ){
-		isplib_error("Failed to read part id\n");
+		isplib_error("Failed to set baud rate %ld\n", baud);
 		return -1;
 	}
-	if ( ret == 0 ){
-		get_line(buf, 64, TIMEOUT);
-		ret = atoi(buf);
+
+	if( ret == 0 ){
+		m_uart_attr.o_flags = Uart::FLAG_IS_PARITY_NONE;
+		m_uart_attr.o_flags |= (stop_bits == 2) ? Uart::FLAG_IS_STOP2 : Uart::FLAG_IS_STOP1;
+		if( set_uart_baud_rate(baud) < 0 ){
+			return -1;
+		}
 	}
+
 	return ret;
 }
 
-/*! \brief reads the boot loader version.
- * \details This function reads the boot loader version.
- * \return The bootloader version
+const u32 * LpcPhy::default_baud_ladder(){ return baud_ladder; }
+
+/*! \details This function steps through the baud rate ladder once the bootloader
+ * is synchronized and unlocked. A rate is kept only if the part ID can be read
+ * back at that rate. If it can't, the bootloader is returned to the last rate that worked.
+ *
+ * \return Zero if the link is up (at whatever rate) or -1 if the link was lost
  */
-u32 LpcPhy::read_boot_version(){
-	char buf[64];
-	u16 ret;
-	u8 minor;
-	u8 major;
-	isplib_debug(DEBUG_LEVEL+1, "read boot version\n");
-	sprintf(buf, "K");
+int LpcPhy::escalate_baud_rate(u32 crystal, u32 part_id){
+	int i;
+	u32 previous;
+
+	for(i=0; m_baud_ladder[i] != 0; i++){
+
+		if( m_baud_ladder[i] <= m_uart_attr.freq ){
+			continue;
+		}
+
+		if( is_baud_rate_valid(crystal, m_baud_ladder[i]) == false ){
+			m_trace.sprintf("Skip Baud %ld", m_baud_ladder[i]);
+			m_trace.trace_message();
+			continue;
+		}
+
+		previous = m_uart_attr.freq;
+		if( set_baud_rate(m_baud_ladder[i]) != 0 ){
+			//the bootloader rejected the rate and is still at the previous rate
+			m_trace.sprintf("Baud %ld rejected", m_baud_ladder[i]);
+			m_trace.trace_warning();
+			set_uart_baud_rate(previous);
+			return 0;
+		}
+
+		if( confirm_baud_rate(part_id) == 0 ){
+			isplib_debug(DEBUG_LEVEL, "Running at %ld bps\n", m_baud_ladder[i]);
+			m_trace.sprintf("Baud %ld", m_baud_ladder[i]);
+			m_trace.trace_message();
+			continue;
+		}
+
+		//drop back to the last rate that worked
+		m_trace.sprintf("Baud %ld failed", m_baud_ladder[i]);
+		m_trace.trace_warning();
+		if( (set_baud_rate(previous) == 0) && (confirm_baud_rate(part_id) == 0) ){
+			return 0;
+		}
+
+		//the bootloader may never have switched
+		set_uart_baud_rate(previous);
+		if( confirm_baud_rate(part_id) == 0 ){
+			return 0;
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int LpcPhy::set_uart_baud_rate(u32 baud){
+	m_uart_attr.freq = baud;
+	if( m_uart.set_attr(m_uart_attr) < 0 ){
+		isplib_error("Failed to set baud rate\n");
+		m_trace.sprintf("Set Baud rate %ld", baud);
+		m_trace.trace_error();
+		return -1;
+	}
+	return 0;
+}
+
+int LpcPhy::confirm_baud_rate(u32 part_id){
+	int retry;
+	Timer::wait_msec(10);
+	this->flush();
+	for(retry=0; retry < 2; retry++){
+		if( read_part_id() == part_id ){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*! \details Checks whether the LPC UART can generate \a baud from \a crystal
+ * using the integer divider plus the fractional divider (within 1.5%).
+ */
+bool LpcPhy::is_baud_rate_valid(u32 crystal, u32 baud){
+	u32 clock;
+	u32 divider;
+	u32 mul;
+	u32 div;
+	u32 actual;
+	u32 error;
+
+	//crystal may be specified in KHz or Hz
+	clock = crystal < 1000000 ? crystal*1000 : crystal;
+	if( clock / 16 < baud ){
+		return false;
+	}
+
+	for(mul=1; mul < 16; mul++){
+		for(div=0; div < mul; div++){
+			//baud = clock / (16 * divider * (1 + div/mul))
+			divider = (clock * mul) / (16 * baud * (mul + div));
+			if( divider == 0 ){
+				continue;
+			}
+			actual = (clock * mul) / (16 * divider * (mul + div));
+			error = actual > baud ? actual - baud : baud - actual;
+			if( error * 1000 <= baud * 15 ){
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/*! \brief reads the part ID.
+ * \details This function reads the part ID.
+ * \return The part ID value
+ */
+u32 LpcPhy::read_part_id(){
+	char buf[64];
+	int ret;
+	isplib_debug(DEBUG_LEVEL+1, "read part id\n");
+	sprintf(buf, "J");
+	if( (ret = send_command(buf, QUICK_TIMEOUT)) < 0 ){
+		isplib_error("Failed to read part id\n");
+		return -1;
+	}
+	if ( ret == 0 ){
+		get_line(buf, 64, TIMEOUT);
+		ret = atoi(buf);
+	}
+	return ret;
+}
+
+/*! \brief reads the boot loader version.
+ * \details This function reads the boot loader version.
+ * \return The bootloader version
+ */
+u32 LpcPhy::read_boot_version(){
+	char buf[64];
+	u16 ret;
+	u8 minor;
+	u8 major;
+	isplib_debug(DEBUG_LEVEL+1, "read boot version\n");
+	sprintf(buf, "K");
 	if( (ret = send_command(buf, QUICK_TIMEOUT)) < 0 ){
 		isplib_error("Failed to read boot version\n");
 		return -1;
@@ -959,6 +1455,44 @@ u32 LpcPhy::read_boot_version(){
 	return ret;
 }
 
+/*! \details This function sends the "S" command which has the target
+ * calculate a CRC32 over a block of memory. If the bootloader doesn't support
+ * the command, read_crc() is disabled for the rest of the session.
+ * \return Zero on success, an LPC return code or -1 on error
+ */
+int LpcPhy::read_crc(u32 addr, u32 size, u32 * crc){
+	char buf[64];
+	int ret;
+
+	if( m_is_read_crc == false ){
+		return LPC_ISP_RET_INVALID_COMMAND;
+	}
+
+	isplib_debug(DEBUG_LEVEL+1, "read crc\n");
+	sprintf(buf, "S %d %d", (int)addr, (int)size);
+	m_stats.verify_commands++;
+	if( (ret = send_command(buf, TIMEOUT)) < 0 ){
+		isplib_error("Failed to read CRC %d %d\n", addr, size);
+		return -1;
+	}
+
+	if( ret == LPC_ISP_RET_INVALID_COMMAND ){
+		isplib_debug(DEBUG_LEVEL, "Bootloader doesn't support read CRC\n");
+		m_is_read_crc = false;
+		return ret;
+	}
+
+	if( ret == 0 ){
+		if( get_line(buf, 64, QUICK_TIMEOUT) <= 0 ){
+			return -1;
+		}
+		*crc = strtoul(buf, 0, 10);
+		m_stats.verify_bytes += size;
+	}
+
+	return ret;
+}
+
 /*! \brief compares the specified block of memory.
  * \details This function compares the specified block of memory.
  * \Zero if memory is equal.
@@ -1052,18 +1586,40 @@ int LpcPhy::wait_response(const char * response, u16 timeout){
  */
 s32 LpcPhy::write_data(void * src /*! A pointer to the source data */,
 		u32 size /*! The number of bytes to write */){
+	Timer timer;
+	s32 ret;
+
+	timer.start();
+	if( m_encoded_size ){
+		ret = write_data_encoded(size);
+	} else if( is_uuencode() && is_encode_pipeline() ){
+		ret = write_data_pipeline(src, size);
+	} else {
+		ret = write_data_line(src, size);
+	}
+	timer.stop();
+
+	if( ret > 0 ){
+		m_stats.data_bytes += ret;
+		m_stats.data_usec += timer.calc_usec();
+	}
+
+	return ret;
+}
+
+/*! \details This function encodes and sends one line at a time. */
+s32 LpcPhy::write_data_line(void * src, u32 size){
 	u32 bytes_written;
 
 	if( is_uuencode() ){
 		char buf[1024];
 		u8 line;
 		int checksum_ok;
-		u32 checksum;
+		uint32_t checksum;
 		u8 line_size;
-		u8 i;
 		u32 bytes_verified;
 		u16 retry;
-		u32 bytes;
+		u32 len;
 		char * srcp = (char*)src;
 
 		bytes_written = 0;
@@ -1078,16 +1634,12 @@ s32 LpcPhy::write_data(void * src /*! A pointer to the source data */,
 			} else {
 				line_size = 45;
 			}
-			for(i=0; i < line_size; i++){
-				checksum+=((unsigned char*)src)[i+bytes_written];
-			}
+			len = uu_encode_block(buf, &(srcp[bytes_written]), line_size, &checksum);
 			isplib_debug(DEBUG_LEVEL+1, "Line size is %d (checksum=%d)\n", line_size, checksum);
-			uu_encode_line(buf, &(srcp[bytes_written]), line_size);
-			bytes = m_uart.write(buf, strlen(buf));
-			if ( bytes != strlen(buf) ){
+			if ( uart_write(buf, len) != (int)len ){
 				return -1;
 			}
-			isplib_debug(DEBUG_LEVEL+1, "Sending %s (%d)\n", buf, (int)strlen(buf));
+			isplib_debug(DEBUG_LEVEL+1, "Sending %s (%d)\n", buf, (int)len);
 			if ( m_echo ) {
 				if ( wait_response(buf, QUICK_TIMEOUT) ){
 					isplib_debug(DEBUG_LEVEL+1, "Failed echo\n");
@@ -1102,22 +1654,10 @@ s32 LpcPhy::write_data(void * src /*! A pointer to the source data */,
 				}
 				line = 0;
 				//send and reset the checksum
-				isplib_debug(DEBUG_LEVEL+1, "Sending checksum (%d)\n", checksum);
-				sprintf(buf, "%d\r\n", (int)checksum);
-				bytes = m_uart.write(buf, strlen(buf));
-				if ( bytes != strlen(buf) ){
+				if( (checksum_ok = send_checksum(checksum)) < 0 ){
 					return -1;
 				}
-				if ( m_echo ){
-					sprintf(buf, "%d\rOK\r\n", (int)checksum);
-					checksum_ok = !(wait_response(buf, QUICK_TIMEOUT));
-				} else {
-					memset(buf, 0, 64);
-					get_line(buf, 1024, TIMEOUT);
-					isplib_debug(DEBUG_LEVEL+1, "Checksum response is %s\n", buf);
-					checksum_ok = !(strcmp(buf, "OK\r\n"));
-				}
-
+				checksum_ok = !checksum_ok;
 				checksum = 0;
 
 				//device should respond with OK or RESEND
@@ -1138,9 +1678,393 @@ s32 LpcPhy::write_data(void * src /*! A pointer to the source data */,
 			}
 		} while(bytes_written < size);
 	} else {
-		bytes_written = m_uart.write(src,size);
+		bytes_written = uart_write(src,size);
+	}
+
+	return bytes_written;
+}
+
+/*! \details This function sends checksum blocks that are encoded ahead of
+ * time by the encoder thread. A block that must be resent is replayed
+ * from its buffer.
+ * \return Number of bytes written, <0 on error
+ */
+s32 LpcPhy::write_data_pipeline(void * src, u32 size){
+	const uu_block_t * block;
+	u32 index;
+	u32 bytes_verified;
+	u16 retry;
+	int ret;
+
+	//write_memory() may have started encoding while the last copy to flash completed
+	if( m_encode_pipeline.is_started(src, size) == false ){
+		m_encode_pipeline.start(src, size);
+	}
+
+	if( is_speculate() ){
+		return write_data_speculative(size);
+	}
+
+	bytes_verified = 0;
+	retry = 0;
+	index = 0;
+	while( index < m_encode_pipeline.block_count() ){
+		block = m_encode_pipeline.wait_block(index);
+
+		if( (m_echo == 0) && is_batch_write() ){
+			//lines and checksum in a single write
+			if( uart_write(block->data, block->frame_size) != block->frame_size ){
+				ret = -1;
+			} else {
+				ret = read_checksum_response(block->checksum);
+			}
+		} else if( (ret = write_block(block)) == 0 ){
+			ret = send_checksum(block->checksum);
+		}
+
+		if( ret < 0 ){
+			m_encode_pipeline.finish();
+			return -1;
+		}
+
+		//device should respond with OK or RESEND
+		if( ret > 0 ){
+			isplib_debug(DEBUG_LEVEL+1, "Error data must be resent\n");
+			retry++;
+			if( (retry == 3) || (this->flush() < 0) ){
+				m_encode_pipeline.finish();
+				return -1;
+			}
+		} else {
+			bytes_verified += block->bytes;
+			m_encode_pipeline.release_block(index);
+			index++;
+			retry = 0;
+		}
+	}
+
+	m_encode_pipeline.finish();
+	return bytes_verified;
+}
+
+/*! \details This function sends the blocks of the encoder pipeline like
+ * write_data_pipeline() but sends a block before the response to the previous
+ * one arrives when both are full blocks (see set_speculate()).
+ *
+ * After a RESEND, the bootloader takes the block that was sent ahead as the
+ * retransmission. If it is accepted, its data is in RAM where the resent block
+ * belongs; the block is marked in m_repair_map for write_ram() to write again.
+ * If it isn't, the resent block is sent again from its buffer.
+ * \return Number of bytes written, <0 on error
+ */
+s32 LpcPhy::write_data_speculative(u32 size){
+	char buf[UU_CHECKSUM_SIZE+1];
+	const uu_block_t * block;
+	u32 index; //oldest block without a response
+	u32 sent; //blocks sent
+	u32 count;
+	u32 bytes_verified;
+	u16 retry;
+	int len;
+	int ret;
+
+	count = m_encode_pipeline.block_count();
+	bytes_verified = 0;
+	retry = 0;
+	index = 0;
+	sent = 0;
+	while( index < count ){
+
+		//a full block goes out behind the block waiting for its response
+		while( (sent < count) &&
+				((sent == index) || ((sent == index + 1) && ((sent + 1) * UU_BLOCK_BYTES <= size))) ){
+			block = m_encode_pipeline.wait_block(sent);
+			if( m_is_probe_resend && (sent == 0) ){
+				//the bootloader answers RESEND and takes the next block as the retransmission
+				m_is_probe_resend = false;
+				len = sprintf(buf, "%ld\r\n", (long)(block->checksum + 1));
+				if( (uart_write(block->data, block->size) != block->size) || (uart_write(buf, len) != len) ){
+					break;
+				}
+			} else if( uart_write(block->data, block->frame_size) != block->frame_size ){
+				break;
+			}
+			if( sent > index ){
+				m_stats.speculative_blocks++;
+			}
+			sent++;
+		}
+
+		block = m_encode_pipeline.wait_block(index);
+		if( (sent == index) || ((ret = read_checksum_response(block->checksum)) < 0) ){
+			break;
+		}
+
+		if( ret == 0 ){
+			bytes_verified += block->bytes;
+			m_encode_pipeline.release_block(index);
+			index++;
+			retry = 0;
+			continue;
+		}
+
+		isplib_debug(DEBUG_LEVEL+1, "Error data must be resent\n");
+		retry++;
+		if( retry == 3 ){
+			break;
+		}
+
+		if( sent > index + 1 ){
+			//the block sent ahead was taken as the retransmission
+			m_stats.speculative_misses++;
+			if( (ret = read_checksum_response(m_encode_pipeline.wait_block(index + 1)->checksum)) < 0 ){
+				break;
+			}
+
+			if( ret == 0 ){
+				m_repair_map |= (1<<index);
+				bytes_verified += block->bytes;
+				m_encode_pipeline.release_block(index);
+				index++;
+				retry = 0;
+			}
+		}
+
+		sent = index;
+		if( this->flush() < 0 ){
+			break;
+		}
+	}
+
+	m_encode_pipeline.finish();
+
+	if( index < count ){
+		//stop and wait from now on
+		m_speculate = SPECULATE_OFF;
+		return -1;
+	}
+
+	return bytes_verified;
+}
+
+/*! \details Checks if the bootloader accepts blocks sent ahead of a checksum
+ * response by writing a test pattern to RAM this way and reading it back. The
+ * first block is sent with a bad checksum, so the pattern is only intact if
+ * the block sent ahead is repaired after the RESEND.
+ * \return Zero if it does, 1 if the pattern didn't arrive intact or less
+ * than zero if the bootloader stopped responding
+ */
+int LpcPhy::probe_speculate(){
+	char pattern[LPCPHY_SPECULATE_PROBE_SIZE];
+	u32 misses;
+	u32 i;
+	int ret;
+
+	for(i=0; i < LPCPHY_SPECULATE_PROBE_SIZE; i++){
+		pattern[i] = i*37 + (i>>8);
+	}
+
+	m_speculate = SPECULATE_PROBE;
+	m_is_probe_resend = true;
+	misses = m_stats.speculative_misses;
+	ret = write_ram(m_ram_buffer, pattern, LPCPHY_SPECULATE_PROBE_SIZE);
+	m_is_probe_resend = false;
+	if( ret != 0 ){
+		return -1;
+	}
+
+	if( m_stats.speculative_misses == misses ){
+		//the bad checksum wasn't answered with RESEND
+		return 1;
+	}
+
+	//the pattern is read back over itself
+	if( read_mem(pattern, m_ram_buffer, LPCPHY_SPECULATE_PROBE_SIZE) != LPCPHY_SPECULATE_PROBE_SIZE ){
+		return -1;
+	}
+
+	for(i=0; i < LPCPHY_SPECULATE_PROBE_SIZE; i++){
+		if( pattern[i] != (char)(i*37 + (i>>8)) ){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*! \details This function decides if blocks are sent ahead of checksum
+ * responses (see set_speculate()). If the bootloader loses track of the
+ * data while it is checked, writing fails: syncing again would reset the
+ * device after it was erased.
+ * \return Zero on success
+ */
+int LpcPhy::start_speculate(){
+	int ret;
+
+	if( m_encoded_size ){
+		//the probe would send the pending pre-encoded blocks instead of its pattern
+		return 0;
+	}
+
+	m_speculate = SPECULATE_OFF;
+	if( (m_echo != 0) || (is_uuencode() == false) || (is_encode_pipeline() == false) || (is_batch_write() == false) ||
+			(m_ram_buffer_size < LPCPHY_SPECULATE_PROBE_SIZE) || (m_ram_window_size < LPCPHY_SPECULATE_PROBE_SIZE) ){
+		//there is never more than one full block per write to RAM
+		return 0;
+	}
+
+	ret = probe_speculate();
+	if( ret == 0 ){
+		m_speculate = SPECULATE_ON;
+		return 0;
+	}
+
+	m_speculate = SPECULATE_OFF;
+	if( ret < 0 ){
+		isplib_error("Blocks sent ahead were lost (program again without speculation)\n");
+		this->flush();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \details This function sends \a size bytes worth of the blocks given
+ * to set_encoded(). Each block is already framed with its checksum line
+ * so it is sent with one write.
+ * \return Number of bytes written, <0 on error
+ */
+s32 LpcPhy::write_data_encoded(u32 size){
+	lpc_artifact_block_t block;
+	u32 block_size;
+	u32 bytes_verified;
+	u16 retry;
+	int ret;
+
+	bytes_verified = 0;
+	retry = 0;
+	while( bytes_verified < size ){
+		if( m_encoded_size < sizeof(block) ){
+			return -1;
+		}
+
+		memcpy(&block, m_encoded, sizeof(block));
+		block_size = LPC_ARTIFACT_BLOCK_SIZE(block.frame_size);
+		if( (block_size > m_encoded_size) || (bytes_verified + block.bytes > size) ){
+			isplib_error("Encoded block doesn't fit the write\n");
+			return -1;
+		}
+
+		if( uart_write(m_encoded + sizeof(block), block.frame_size) != block.frame_size ){
+			return -1;
+		}
+
+		if( (ret = read_checksum_response(block.checksum)) < 0 ){
+			return -1;
+		}
+
+		//device should respond with OK or RESEND
+		if( ret > 0 ){
+			isplib_debug(DEBUG_LEVEL+1, "Error data must be resent\n");
+			retry++;
+			if( (retry == 3) || (this->flush() < 0) ){
+				return -1;
+			}
+		} else {
+			bytes_verified += block.bytes;
+			m_encoded += block_size;
+			m_encoded_size -= block_size;
+			retry = 0;
+		}
+	}
+
+	return bytes_verified;
+}
+
+/*! \details This function sends the lines of an encoded block.
+ * \return Zero on success
+ */
+int LpcPhy::write_block(const uu_block_t * block){
+	char buf[UU_LINE_SIZE+1];
+	const char * line;
+	u16 len;
+	u8 i;
+
+	line = block->data;
+	for(i=0; i < block->lines; i++){
+		//length character + 4 characters per 3 bytes + <CR><LF>
+		len = (((line[0] - ' ') & 0x3F) + 2) / 3 * 4 + 3;
+		if( uart_write(line, len) != len ){
+			return -1;
+		}
+		if( m_echo ){
+			memcpy(buf, line, len);
+			buf[len] = 0;
+			if ( wait_response(buf, QUICK_TIMEOUT) ){
+				isplib_debug(DEBUG_LEVEL+1, "Failed echo\n");
+			}
+		}
+		line += len;
+	}
+
+	return 0;
+}
+
+/*! \details This function sends the checksum that follows a block of
+ * uuencoded lines and reads the response.
+ * \return Zero for OK, 1 for RESEND and <0 on error
+ */
+int LpcPhy::send_checksum(u32 checksum){
+	char buf[64];
+	int len;
+
+	isplib_debug(DEBUG_LEVEL+1, "Sending checksum (%d)\n", (int)checksum);
+	len = sprintf(buf, "%d\r\n", (int)checksum);
+	if ( uart_write(buf, len) != len ){
+		return -1;
+	}
+
+	return read_checksum_response(checksum);
+}
+
+/*! \details This function reads the response to a checksum line.
+ * \return Zero for OK, 1 for RESEND and <0 on error
+ */
+int LpcPhy::read_checksum_response(u32 checksum){
+	char buf[64];
+	int checksum_ok;
+
+	if ( m_echo ){
+		sprintf(buf, "%d\rOK\r\n", (int)checksum);
+		checksum_ok = !(wait_response(buf, QUICK_TIMEOUT));
+	} else {
+		get_line(buf, 64, TIMEOUT);
+		isplib_debug(DEBUG_LEVEL+1, "Checksum response is %s\n", buf);
+		checksum_ok = !(strcmp(buf, "OK\r\n"));
 	}
 
+	return checksum_ok ? 0 : 1;
+}
+
+/*! \details This function writes to the UART. A block may be
+ * accepted in more than one piece so writing continues until all of \a buf is sent.
+ * \return Number of bytes written or <0 on error
+ */
+int LpcPhy::uart_write(const void * buf, int nbyte){
+	int bytes_written;
+	int ret;
+
+	bytes_written = 0;
+	do {
+		ret = m_uart.write((const char*)buf + bytes_written, nbyte - bytes_written);
+		m_stats.tx_writes++;
+		if( ret <= 0 ){
+			return bytes_written ? bytes_written : ret;
+		}
+		m_stats.tx_bytes += ret;
+		bytes_written += ret;
+	} while( bytes_written < nbyte );
+
 	return bytes_written;
 }
 
@@ -1154,189 +2078,422 @@ s32 LpcPhy::read_data(void * dest /*! A pointer to the destination buffer */,
 	u32 bytes_read;
 
 	if( is_uuencode() ){
-		u16 j;
-		u8 retry;
-		u16 checksum;
-		u16 line;
 		char buf[128];
-		char buf_dec[128];
-		u32 bytes;
-		u16 bytes_verified;
-		u16 bytes_decoded;
+		uint32_t checksum;
+		u32 bytes_verified;
+		u32 bytes_decoded;
+		int len;
+		u8 retry;
+		u8 line;
 		bytes_read = 0;
 		bytes_verified = 0;
+		checksum = 0;
 		retry = 0;
 		line = 0;
 		do {
 
-			//Grab a line from the UART
-			memset(buf, 0, 128);
-			memset(buf_dec, 0, 128);
-			get_line(buf, 128, TIMEOUT);
+			//Grab a line from the UART and decode it in place in the destination buffer
+			if( (len = get_line(buf, 128, TIMEOUT)) <= 0 ){
+				isplib_debug(DEBUG_LEVEL, "Timeout reading data\n");
+				return bytes_verified;
+			}
+
 			isplib_debug(4, "rx'd:%s\n", buf);
-			if ( (bytes_decoded = uu_decode_line(buf_dec, buf, 64)) ){
-				//The line did uu decode--so copy the data to the destination buffer
-				isplib_debug(4, "read %d bytes\n", bytes_decoded);
-				memcpy(&((char*)dest)[bytes_read], buf_dec, bytes_decoded);
+			bytes_decoded = uu_decode_block((char*)dest + bytes_read, size - bytes_read, buf, len, 0, &checksum);
+			if ( bytes_decoded ){
+				isplib_debug(4, "read %ld bytes\n", bytes_decoded);
 				bytes_read += bytes_decoded;
 				line++;
 			}
 
 			if ( (line == 20) || (bytes_read == size) ){
+				line = 0;
 
-				if ( line == 20 ){
-					isplib_debug(DEBUG_LEVEL+1, "Sending 20th line checksum\n");
-				}
-				//The line didn't uu decode--so it must be a checksum line
-				checksum = 0;
-				for(j=bytes_verified; j < bytes_read; j++){
-					checksum += ((unsigned char*)dest)[j];
-				}
-
-				//The last line was decoded -- grab the checksum value
-				if ( bytes_read == size ){
-					get_line(buf, 128, TIMEOUT);
+				//the checksum line follows every 20 lines and the last line
+				if( get_line(buf, 128, TIMEOUT) <= 0 ){
+					return bytes_verified;
 				}
 				isplib_debug(4, "This is a checksum line:  %s\n", buf);
 
-				if ( checksum == atoi(buf) ){
-					isplib_debug(DEBUG_LEVEL+1, "Checksum is Good (%d)\n", checksum);
-					sprintf(buf, "OK\r\n");
-					bytes = m_uart.write(buf, strlen(buf));
-					if ( bytes != strlen(buf) ){
-						return -1;
-					}
-					if ( m_echo) {
-						wait_response(buf, TIMEOUT);
-					}
+				if ( checksum == strtoul(buf, 0, 10) ){
+					isplib_debug(DEBUG_LEVEL+1, "Checksum is Good (%ld)\n", (u32)checksum);
+					strcpy(buf, "OK\r\n");
 					bytes_verified = bytes_read;
+					retry = 0;
 				} else {
-					isplib_debug(DEBUG_LEVEL+1, "TODO--Re-read the data\n");
-					sprintf(buf, "RESEND\r\n");
-					bytes = m_uart.write(buf, strlen(buf));
-					if ( bytes != strlen(buf) ){
-						return -1;
-					}
-					if ( m_echo) wait_response(buf, TIMEOUT);
+					isplib_debug(DEBUG_LEVEL+1, "Checksum failed--data will be sent again\n");
+					strcpy(buf, "RESEND\r\n");
 					bytes_read = bytes_verified;
 					retry++;
-					if (retry == 3 ) return bytes_read;
+				}
+				checksum = 0;
+
+				len = strlen(buf);
+				if ( uart_write(buf, len) != len ){
+					return -1;
+				}
+				if ( m_echo ){
+					wait_response(buf, TIMEOUT);
+				}
+
+				if( retry == 3 ){
+					return bytes_verified;
 				}
 			}
 
 		} while( bytes_read < size );
 	} else {
-		u32 timeout;
+		LpcDeadline deadline(QUICK_TIMEOUT);
 		int ret;
 		char * destp = (char*)dest;
-		bytes_read = 0;
-		timeout = 0;
-		do {
+		//anything get_line() has already pulled off the UART comes first
+		bytes_read = read_rx_buffer(destp, size);
+		while( bytes_read < size ){
 			ret = m_uart.read(destp + bytes_read, size - bytes_read);
 			if( ret > 0 ){
+				m_stats.rx_bytes += ret;
 				bytes_read += ret;
-				timeout = 0;
-			} else {
-				timeout++;
-				Timer::wait_msec(1);
-				if( timeout > QUICK_TIMEOUT ){
-					return bytes_read;
-				}
+				deadline.restart();
+			} else if( wait_rx(deadline) == 0 ){
+				return bytes_read;
 			}
-		} while( bytes_read < size );
+		}
 	}
 
 	return bytes_read;
 }
 
+/*! \brief reads a line from the UART.
+ * \details This function returns the next line (up to and including
+ * '\n') or \a nbyte bytes, whichever comes first. Everything available
+ * on the UART is drained into the receive ring in one read; bytes beyond
+ * the line stay in the ring for the next call. The line is zero terminated
+ * if it is shorter than \a nbyte.
+ * \return Number of bytes copied to \a buf, 0 on timeout or -1 on error
+ */
 int LpcPhy::get_line(void * buf, int nbyte, int max_wait){
-	int bytes_recv;
-	int page_size;
+	LpcDeadline deadline(max_wait);
 	int bytes_read;
-	int timeout;
-	char * start = (char*)buf;
-	int i;
-	char * p;
-	p = (char*)buf;
+	int len;
+	char c;
+
+	((char*)buf)[0] = 0;
+
+	//a call with a larger nbyte that timed out may have scanned past this
+	//one's limit; scanned bytes never hold a newline
+	if( (u16)(m_rx_scan - m_rx_tail) >= nbyte ){
+		m_rx_scan = m_rx_tail + nbyte;
+		return read_line(buf, nbyte, nbyte);
+	}
 
-	timeout = 0;
-	bytes_recv = 0;
-	memset(buf, 0, nbyte);
 	do {
-		//this needs to read up to the newline
-		page_size = (( nbyte - bytes_recv ) > 1) ? 1 : (nbyte - bytes_recv);
-		if ( (bytes_read = m_uart.read(p,  page_size)) < 0 ){
+
+		//scan only the bytes that have not been scanned by a previous pass
+		while( m_rx_scan != m_rx_head ){
+			c = m_rx_buffer[m_rx_scan & (LPCPHY_RX_BUFFER_SIZE-1)];
+			m_rx_scan++;
+			len = (u16)(m_rx_scan - m_rx_tail);
+
+#if defined __link
+			if ( c == '\n' ){
+				isplib_debug(DEBUG_LEVEL+3, "<LF>\n");
+			} else if ( c == '\r' ){
+				isplib_debug(DEBUG_LEVEL+3, "<CR>\n");
+			} else {
+				isplib_debug(DEBUG_LEVEL+3, "%c\n", c);
+			}
+#endif
+
+			if( (c == '\n') || (len >= nbyte) ){
+				return read_line(buf, len, nbyte);
+			}
+		}
+
+		if( rx_buffer_count() == LPCPHY_RX_BUFFER_SIZE ){
+			//the line is longer than the ring
+			return read_line(buf, nbyte, nbyte);
+		}
+
+		if( (bytes_read = fill_rx_buffer()) < 0 ){
+			return -1;
+		}
+
+		if( bytes_read == 0 ){
+			if( wait_rx(deadline) == 0 ){
+				return 0;
+			}
+		} else {
+			isplib_debug(DEBUG_LEVEL+3, "Read %d bytes\n", bytes_read);
+		}
+
+	} while( 1 );
+
+	return 0;
+}
+
+/*! \details This function waits for the UART to receive something.
+ * On Stratify, the UART is polled with the time left before \a deadline so
+ * nothing runs while the bootloader is busy. If the driver can't be polled,
+ * this waits 1ms and the caller reads again. On the link, the UART handle
+ * belongs to the device and each read is already a round trip, so the caller
+ * just reads again.
+ * \return Zero once \a deadline has passed, 1 if the UART may have data
+ */
+int LpcPhy::wait_rx(const LpcDeadline & deadline){
+#if !defined __link
+	struct pollfd fds;
+	int ret;
+#endif
+
+	if( deadline.is_expired() ){
+		return 0;
+	}
+
+#if !defined __link
+	if( m_is_poll ){
+		fds.fd = m_uart.fileno();
+		fds.events = POLLIN;
+		fds.revents = 0;
+		ret = poll(&fds, 1, deadline.remaining_msec());
+		if( (ret >= 0) && ((fds.revents & (POLLERR | POLLNVAL)) == 0) ){
+			return ret > 0;
+		}
+		if( (ret < 0) && (errno == EINTR) ){
+			return 1;
+		}
+		isplib_debug(DEBUG_LEVEL, "UART can't be polled--wait 1ms at a time\n");
+		m_is_poll = false;
+	}
+
+	Timer::wait_msec(1);
+#endif
+	return 1;
+}
+
+/*! \details This function copies a line from the receive ring and
+ * zero terminates it if it is shorter than \a nbyte.
+ * \return Number of bytes copied
+ */
+int LpcPhy::read_line(void * buf, int len, int nbyte){
+	if( len > nbyte ){
+		len = nbyte;
+	}
+	len = read_rx_buffer(buf, len);
+	if( len < nbyte ){
+		((char*)buf)[len] = 0;
+	}
+	return len;
+}
+
+/*! \details This function moves everything the UART has available
+ * into the receive ring.
+ * \return Number of bytes added to the ring or -1 on error
+ */
+int LpcPhy::fill_rx_buffer(){
+	int bytes_read;
+	int total;
+	u16 offset;
+	u16 page_size;
+
+	total = 0;
+	do {
+		page_size = LPCPHY_RX_BUFFER_SIZE - rx_buffer_count();
+		if( page_size == 0 ){
+			break;
+		}
+
+		//read up to the end of the ring then wrap on the next pass
+		offset = m_rx_head & (LPCPHY_RX_BUFFER_SIZE-1);
+		if( page_size > LPCPHY_RX_BUFFER_SIZE - offset ){
+			page_size = LPCPHY_RX_BUFFER_SIZE - offset;
+		}
+
+		if ( (bytes_read = m_uart.read(m_rx_buffer + offset, page_size)) < 0 ){
 #if !defined __link
 			if( errno != EAGAIN ){
 				m_trace.assign("uart read failed");
 				m_trace.trace_error();
 				return -1;
 			}
+			break;
 #else
 			return -1;
 #endif
 		}
 
-		if( bytes_read > 0 ){
+		m_rx_head += bytes_read;
+		m_stats.rx_bytes += bytes_read;
+		total += bytes_read;
+	} while( bytes_read == page_size );
 
-			isplib_debug(DEBUG_LEVEL+3, "Read %d bytes\n", bytes_read);
-			bytes_recv+=bytes_read;
-			p+=bytes_read;
+	return total;
+}
 
-			//scan for newline
-			for(i=0; i < bytes_recv; i++){
+/*! \details This function consumes up to \a nbyte bytes from
+ * the receive ring.
+ * \return The number of bytes copied to \a buf
+ */
+int LpcPhy::read_rx_buffer(void * buf, int nbyte){
+	char * dest = (char*)buf;
+	u16 offset;
+	int page_size;
+	int bytes_read;
 
-#if defined __link
-				if ( start[i] == '\n' ){
-					isplib_debug(DEBUG_LEVEL+3, "<LF>\n");
-				} else if ( start[i] == '\r' ){
-					isplib_debug(DEBUG_LEVEL+3, "<CR>\n");
-				} else {
-					isplib_debug(DEBUG_LEVEL+3, "%c\n", start[i]);
-				}
-#endif
+	if( nbyte > rx_buffer_count() ){
+		nbyte = rx_buffer_count();
+	}
 
-				if ( start[i] == '\n' ){
-					start[i+1] = 0; //zero terminate
-					if ( i+1 < bytes_recv ){
-						isplib_debug(DEBUG_LEVEL+2, "-----------------------Extra bytes %d------------------\n", bytes_recv - i - 1);
-					}
-					return i+1;
-				}
-			}
+	bytes_read = 0;
+	while( bytes_read < nbyte ){
+		offset = m_rx_tail & (LPCPHY_RX_BUFFER_SIZE-1);
+		page_size = LPCPHY_RX_BUFFER_SIZE - offset;
+		if( page_size > nbyte - bytes_read ){
+			page_size = nbyte - bytes_read;
 		}
+		memcpy(dest + bytes_read, m_rx_buffer + offset, page_size);
+		m_rx_tail += page_size;
+		bytes_read += page_size;
+	}
 
-#if !defined __link
-		Timer::wait_msec(1);
-#endif
-		timeout++;
-		if ( timeout == max_wait ){
-			return 0;
-		}
-	} while(bytes_recv < nbyte);
+	//bytes that were consumed don't need to be scanned again
+	if( (u16)(m_rx_head - m_rx_scan) > rx_buffer_count() ){
+		m_rx_scan = m_rx_tail;
+	}
 
-	return bytes_recv;
+	return bytes_read;
 }
 
-int LpcPhy::send_command(const char * cmd, int timeout, int wait_ms){
-	u32 bytes;
+int LpcPhy::send_command(const char * cmd, int timeout){
 	int ret;
+
+	//the bootloader doesn't accept commands until the last copy to flash is done
+	if( complete_copy() < 0 ){
+		return -1;
+	}
+	if( m_pair_count && (drain_commands() < 0) ){
+		return -1;
+	}
+
+	if( (ret = write_command(cmd)) < 0 ){
+		return ret;
+	}
+
+	return read_command_response(cmd, timeout);
+}
+
+int LpcPhy::write_command(const char * cmd){
+	u32 bytes;
 	int len = strlen(cmd);
 	char buffer[len+16];
 
 	sprintf(buffer, "%s\r\n", cmd);
-	bytes = m_uart.write(buffer, strlen(buffer));
+	bytes = uart_write(buffer, strlen(buffer));
 	if ( bytes != strlen(buffer) ){
 		isplib_error("send command failed %d != %d\n", bytes, (int)strlen(buffer));
 		return -1;
 	}
+	return 0;
+}
+
+/*! \details This function sends \a cmd without waiting for its return code.
+ * The return code of the command before it is read first unless the two
+ * are a pair (see set_command_pair()). drain_commands() reads the rest.
+ * \return Zero if the command was sent
+ */
+int LpcPhy::issue_command(const char * cmd, u16 timeout){
+	lpc_phy_command_t * command;
+
+	//echoed commands and return codes can't be told apart if they overlap
+	while( (m_pair_count == 2) || (m_pair_count && (is_command_pair() == false)) ){
+		if( retire_command() < 0 ){
+			return -1;
+		}
+	}
+
+	if( write_command(cmd) < 0 ){
+		return -1;
+	}
+
+	if( m_pair_count ){
+		m_stats.window_commands++;
+	}
+
+	command = m_pair + m_pair_count;
+	strncpy(command->command, cmd, LPCPHY_COMMAND_SIZE-1);
+	command->command[LPCPHY_COMMAND_SIZE-1] = 0;
+	command->timeout = timeout;
+	m_pair_count++;
+	m_pair_issued++;
+	return 0;
+}
+
+/*! \details This function reads the return code of the older command of the pair.
+ * The first non-zero code is kept for drain_commands().
+ * \return The return code or less than zero if it wasn't received (the pair is dropped)
+ */
+int LpcPhy::retire_command(){
+	int ret;
+
+	if( m_pair_count == 0 ){
+		return 0;
+	}
+
+	ret = read_command_response(m_pair[0].command, m_pair[0].timeout);
+
+	if( (ret != 0) && (m_pair_ret == 0) ){
+		isplib_debug(DEBUG_LEVEL, "%s returned %d\n", m_pair[0].command, ret);
+		m_pair_ret = ret;
+		m_pair_failed = m_pair_issued - m_pair_count;
+	}
+
+	if( ret < 0 ){
+		//the responses can't be matched to the commands anymore
+		m_pair_count = 0;
+		this->flush();
+		return ret;
+	}
+
+	if( m_pair_count == 2 ){
+		m_pair[0] = m_pair[1];
+	}
+	m_pair_count--;
+	return ret;
+}
+
+/*! \details This function reads the return codes of the commands still waiting for one.
+ * \a failed is set to which command (0 for the first issued since the last drain)
+ * returned the first non-zero code. The caller rolls back to that command.
+ * \return Zero if all commands succeeded, the first non-zero return code
+ * or less than zero if a return code wasn't received
+ */
+int LpcPhy::drain_commands(u8 * failed){
+	int ret;
+
+	while( m_pair_count ){
+		if( retire_command() < 0 ){
+			break;
+		}
+	}
 
-	if( wait_ms != 0 ){
-		Timer::wait_msec(wait_ms);
+	ret = m_pair_ret;
+	if( failed ){
+		*failed = m_pair_failed;
 	}
 
+	m_pair_ret = 0;
+	m_pair_failed = 0;
+	m_pair_issued = 0;
+	return ret;
+}
+
+int LpcPhy::read_command_response(const char * cmd, int timeout){
+	int ret;
+	int len = strlen(cmd);
+	char buffer[len+16];
+
 	if( m_echo ){
 		if( is_return_code_newline() ){
+			sprintf(buffer, "%s\r\n", cmd);
 			ret = wait_response(buffer, timeout);
 			if( ret < 0 ){
 				return ret;
@@ -23,9 +23,58 @@ limitations under the License.
 #include <sapi/hal.hpp>
 #include <sapi/sys.hpp>
 
+#include "UuEncodePipeline.hpp"
+#include "lpc_artifact.h"
+
 #define LPC_ISP_UNLOCK_CODE "23130"
 
-#define LPCPHY_RAM_BUFFER_SIZE 1024
+#define LPCPHY_RAM_BUFFER_SIZE 1024 //bytes sent per write to RAM command
+#define LPCPHY_MAX_RAM_BUFFER_SIZE 4096 //largest copy RAM to flash
+#define LPCPHY_RX_BUFFER_SIZE 512 //must be a power of 2
+#define LPCPHY_READ_SIZE 4096 //bytes requested per read memory command
+#define LPCPHY_COMMAND_SIZE 48
+#define LPCPHY_SPECULATE_PROBE_SIZE (2*UU_BLOCK_BYTES) //RAM written to check that blocks can be sent ahead
+#define LPCPHY_ERASE_SECTOR_MSEC 105 //longest erase of one sector in the datasheets
+#define LPCPHY_ERASE_KB_MSEC 2 //added for each KB erased (larger sectors take longer on some parts)
+
+/*! \brief Link statistics used to compare transfer strategies */
+typedef struct {
+	u32 verify_commands; //compare commands sent or read back blocks
+	u32 verify_bytes; //bytes of flash verified
+	u32 verify_usec; //time spent verifying
+	u32 tx_bytes; //bytes written to the UART
+	u32 tx_writes; //calls to Uart::write()
+	u32 rx_bytes; //bytes read from the UART
+	u32 data_bytes; //payload bytes sent by write_data()
+	u32 data_usec; //time spent in write_data()
+	u32 window_commands; //commands sent before the return code of the previous command was read
+	u32 speculative_blocks; //blocks sent before the checksum response of the previous block
+	u32 speculative_misses; //blocks sent ahead that were taken as the retransmission of a resent block
+} lpc_phy_stats_t;
+
+/*! \brief A command waiting for its return code (see LpcPhy::set_command_pair()) */
+typedef struct {
+	char command[LPCPHY_COMMAND_SIZE];
+	u16 timeout;
+} lpc_phy_command_t;
+
+/*! \brief The time a wait gives up at (see LpcPhy::wait_rx()) */
+class LpcDeadline {
+public:
+	/*! \details Sets the deadline \a msec milliseconds from now */
+	LpcDeadline(u32 msec){ m_msec = msec; m_timer.start(); }
+	/*! \details Starts the same wait again from now (e.g. after data arrives) */
+	void restart(){ m_timer.restart(); }
+	bool is_expired() const { return m_timer.calc_msec() >= m_msec; }
+	u32 remaining_msec() const {
+		u32 elapsed = m_timer.calc_msec();
+		return elapsed < m_msec ? m_msec - elapsed : 0;
+	}
+
+private:
+	sys::Timer m_timer;
+	u32 m_msec;
+};
 
 class LpcPhy {
 public:
@@ -35,6 +84,31 @@ public:
 		m_is_return_code_newline = false;
 		m_is_uuencode = false;
 		m_max_speed = MAX_SPEED_115200;
+		m_baud_ladder = default_baud_ladder();
+		m_is_encode_pipeline = true;
+		m_is_batch_write = true;
+		m_verify = VERIFY_PAGE;
+		m_verify_size = 0;
+		m_ram_window_size = LPCPHY_RAM_BUFFER_SIZE;
+		m_ram_buffer_size = LPCPHY_RAM_BUFFER_SIZE;
+		m_is_copy_pending = false;
+		m_is_copy_failed = false;
+		m_boot_version = 0;
+		m_is_read_crc = false;
+		m_encoded = 0;
+		m_encoded_size = 0;
+		m_is_speculate = false;
+		m_speculate = SPECULATE_UNKNOWN;
+		m_repair_map = 0;
+		m_is_probe_resend = false;
+		m_is_poll = true;
+		m_is_command_pair = false;
+		m_pair_count = 0;
+		m_pair_issued = 0;
+		m_pair_ret = 0;
+		m_pair_failed = 0;
+		reset_stats();
+		clear_rx_buffer();
 	}
 
 
@@ -43,9 +117,23 @@ public:
 	int open(int crystal);
 	int close();
 	int write_memory(u32 loc, const void * buf, int nbyte, u32 sector);
+	/*! \details Sends \a blocks (see lpc_artifact.h) instead of encoding \a buf for the next write_memory().
+	 * Use only if is_encoded_write() is true.
+	 */
+	void set_encoded(const char * blocks, u32 size){ m_encoded = blocks; m_encoded_size = size; }
+	/*! \details Returns true if write_memory() sends pre-encoded blocks as they are */
+	bool is_encoded_write() const { return is_uuencode() && (m_echo == 0) && is_batch_write(); }
+	int verify_memory(u32 loc, const void * buf, int nbyte);
+	int verify_flush();
+	int compare_flash(u32 loc, const void * buf, int nbyte);
 	u32 ram_buffer() const { return m_ram_buffer; }
 
 	void set_ram_buffer(u32 addr);
+	/*! \details Sets the number of bytes staged in RAM for each copy to flash (256, 512, 1024 or 4096) */
+	void set_ram_buffer_size(u32 size){ m_ram_buffer_size = size; }
+	u32 ram_buffer_size() const { return m_ram_buffer_size; }
+	/*! \details Sets how much target RAM (from ram_buffer()) VERIFY_SECTOR can hold pages in */
+	void set_ram_window_size(u32 size){ m_ram_window_size = size; }
 	int read_memory(u32 loc, void * buf, int nbyte);
 	int reset();
 	int start_bootloader();
@@ -68,11 +156,32 @@ public:
 	int go(u32 addr /*! Where to start code execution */,
 			char mode /*! 'T' for thumb mode and 'A' for arm mode--default is 'A' */);
 	int erase_sector(u32 start /*! The first sector to erase */,
-			u32 end /*! The last sector to erase--must be >= start */);
+			u32 end /*! The last sector to erase--must be >= start */,
+			u32 size = 0 /*! Bytes in the sectors (0 if not known) */);
+	int prep_erase_sector(u32 start /*! The first sector to erase */,
+			u32 end /*! The last sector to erase--must be >= start */,
+			u32 size = 0 /*! Bytes in the sectors (0 if not known) */);
+	/*! \details Returns how long to wait for the return code of erasing \a sectors sectors holding \a size bytes */
+	static u16 calc_erase_timeout(u32 sectors, u32 size);
 	int blank_check_sector(u32 start /*! The first sector to blank check */,
-			u32 end /*! The last sector to blank check--must be >= start */);
+			u32 end /*! The last sector to blank check--must be >= start */,
+			u32 * offset = 0 /*! Where to store the first non-blank offset (can be null) */);
+	int set_baud_rate(u32 baud /*! The new bit rate for the bootloader and the UART */,
+			u8 stop_bits = 1 /*! Number of stop bits (1 or 2) */);
+	u32 baud_rate() const { return m_uart_attr.freq; }
 	u32 read_part_id();
 	u32 read_boot_version();
+	/*! \details Returns the bootloader version read by open() (major*256 + minor) */
+	u32 boot_version() const { return m_boot_version; }
+	int read_crc(u32 addr /*! The first address--must be a word boundary */,
+			u32 size /*! The number of bytes--must be a multiple of 4 */,
+			u32 * crc /*! Where to store the CRC32 */);
+	/*! \details Allows read_crc() to be used (the bootloader must support the "S" command) */
+	void set_read_crc(bool v = true){ m_is_read_crc = v; }
+	bool is_read_crc() const { return m_is_read_crc; }
+
+	/*! \details Returns the bytes copied to flash for a page of \a page_size bytes */
+	u32 calc_copy_size(u32 page_size) const;
 	int compare_memory(u32 addr0 /*! The beginning of the first block */,
 			u32 addr1 /*! The beginning of the second block */,
 			u32 size /*! The number of bytes to compare */);
@@ -80,6 +189,50 @@ public:
 	void set_uuencode(bool v = true){ m_is_uuencode = v; }
 	bool is_uuencode() const  { return m_is_uuencode; }
 
+	/*! \details Encodes the next checksum block while the current one is transmitted (default) */
+	void set_encode_pipeline(bool v = true){ m_is_encode_pipeline = v; }
+	bool is_encode_pipeline() const { return m_is_encode_pipeline; }
+
+	/*! \details Sends the next checksum block before the response to the previous one arrives.
+	 *
+	 * A block is only sent ahead when it has the same number of lines as the block
+	 * before it, so after a RESEND the bootloader takes it as the retransmission. The
+	 * RAM it landed in is then written again once the data phase is done. Before the
+	 * first page is written, a test pattern is sent this way with one bad checksum,
+	 * so the repair is exercised, and read back. If the pattern doesn't arrive
+	 * intact, every block waits for its response.
+	 */
+	void set_speculate(bool v = true){ m_is_speculate = v; }
+	/*! \details Returns true if blocks are sent ahead of checksum responses (see set_speculate()) */
+	bool is_speculate() const { return (m_speculate >= SPECULATE_PROBE) && (m_echo == 0) && is_batch_write(); }
+	/*! \details Returns true if set_speculate() was requested but the bootloader didn't accept it */
+	bool is_speculate_rejected() const { return m_is_speculate && (m_speculate == SPECULATE_OFF); }
+
+	/*! \details Sends copy (or erase) right behind its prepare and reads both return codes after.
+	 *
+	 * Only the pair is sent ahead. The next write to RAM has to wait for the copy,
+	 * so nothing is queued behind it. The pair is only used when echo is off.
+	 */
+	void set_command_pair(bool v = true){ m_is_command_pair = v; }
+	bool is_command_pair() const { return m_is_command_pair && (m_echo == 0); }
+
+	/*! \details Sends each encoded block and its checksum with one UART write when echo is off (default) */
+	void set_batch_write(bool v = true){ m_is_batch_write = v; }
+	bool is_batch_write() const { return m_is_batch_write; }
+
+	enum {
+		VERIFY_PAGE /*! Compare each page while it is still in target RAM (default) */,
+		VERIFY_SECTOR /*! Keep pages in a RAM window and compare once per sector */,
+		VERIFY_IMAGE /*! Read the image back once it is written (see verify_memory()) */,
+		VERIFY_NONE /*! Don't verify */
+	};
+
+	void set_verify(u8 policy){ m_verify = policy; }
+	u8 verify() const { return m_verify; }
+
+	const lpc_phy_stats_t & stats() const { return m_stats; }
+	void reset_stats(){ memset(&m_stats, 0, sizeof(m_stats)); }
+
 	void set_max_speed(u16 v){
 		m_max_speed = v;
 		if( m_max_speed > MAX_SPEED_9600 ){
@@ -87,6 +240,16 @@ public:
 		}
 	}
 
+	/*! \details Sets the bit rates tried after synchronizing (zero terminated, ascending).
+	 *
+	 * Synchronization always happens at the rates selected by set_max_speed(). Once
+	 * the device is unlocked, each rate in the ladder is tried in turn and kept only
+	 * if the link is confirmed. Pass 0 to stay at the synchronization rate.
+	 *
+	 */
+	void set_baud_ladder(const u32 * ladder){ m_baud_ladder = ladder; }
+	static const u32 * default_baud_ladder();
+
 	enum {
 		MAX_SPEED_115200,
 		MAX_SPEED_78600,
@@ -102,18 +265,96 @@ private:
 	hal::Pin & m_reset;
 	hal::Pin & m_ispreq;
 	u32 m_ram_buffer;
+	u32 m_ram_buffer_size;
 	UartPinAssignment m_pin_assignment;
 	bool m_is_return_code_newline;
 	bool m_is_uuencode;
 	u16 m_max_speed;
+	uart_attr_t m_uart_attr;
+	const u32 * m_baud_ladder;
+	bool m_is_encode_pipeline;
+	bool m_is_batch_write;
+	UuEncodePipeline m_encode_pipeline;
+	lpc_phy_stats_t m_stats;
+	u8 m_verify;
+	u32 m_boot_version;
+	bool m_is_read_crc;
+	bool m_is_speculate;
+	u8 m_speculate;
+	u32 m_repair_map; //blocks of the current write to RAM that must be written again
+	bool m_is_probe_resend; //the next first block is sent with a bad checksum (see probe_speculate())
+	enum {
+		SPECULATE_UNKNOWN,
+		SPECULATE_OFF,
+		SPECULATE_PROBE,
+		SPECULATE_ON
+	};
+	int start_speculate();
+	int probe_speculate();
+	const char * m_encoded; //blocks set_encoded() gave for the next write_memory()
+	u32 m_encoded_size;
+	u32 m_ram_window_size;
+	bool m_is_copy_pending; //a copy to flash was sent but its return code hasn't been read
+	bool m_is_copy_failed;
+	u32 m_copy_loc;
+	u32 m_copy_ram;
+	u32 m_copy_size;
+	u32 m_copy_sector;
+	u32 m_verify_ram;
+	u32 m_verify_flash; //first flash address waiting for VERIFY_SECTOR
+	u32 m_verify_size; //bytes waiting for VERIFY_SECTOR
+	u32 m_verify_sector;
+
+	//a prepare and the copy or erase behind it, waiting for their return codes (oldest first)
+	lpc_phy_command_t m_pair[2];
+	bool m_is_command_pair;
+	u8 m_pair_count;
+	u8 m_pair_issued; //commands issued since the last drain_commands()
+	int m_pair_ret; //first non-zero return code since the last drain_commands()
+	u8 m_pair_failed; //which issued command returned m_pair_ret
+
+	//received bytes that have not been consumed yet
+	char m_rx_buffer[LPCPHY_RX_BUFFER_SIZE];
+	u16 m_rx_head; //next byte to write (free running)
+	u16 m_rx_tail; //next byte to read (free running)
+	u16 m_rx_scan; //next byte to check for a newline (free running)
 
-	int send_command(const char * cmd, int timeout, int wait_ms = 0);
+	int send_command(const char * cmd, int timeout);
+	int write_command(const char * cmd);
+	int read_command_response(const char * cmd, int timeout);
+	int issue_command(const char * cmd, u16 timeout);
+	int retire_command();
+	int drain_commands(u8 * failed = 0);
+	int start_copy(u32 flash_addr, u32 ram_addr, u32 size, u32 sector);
+	int complete_copy();
+	int write_pages(u32 loc, const char * src_data, int nbyte, u32 sector);
+	int write_ram_page(u32 ram_addr, const char * src, u32 page_size, u32 copy_size);
 	s32 write_data(void * src, u32 size);
+	s32 write_data_line(void * src, u32 size);
+	s32 write_data_pipeline(void * src, u32 size);
+	s32 write_data_encoded(u32 size);
+	s32 write_data_speculative(u32 size);
+	u32 calc_chunk_size(u32 page_size, u32 copy_size) const;
+	int write_block(const uu_block_t * block);
+	int send_checksum(u32 checksum);
+	int read_checksum_response(u32 checksum);
+	int uart_write(const void * buf, int nbyte);
 	s32 read_data(void * dest, u32 size);
 	int get_line(void * buf, int nbyte, int max_wait);
+	int wait_rx(const LpcDeadline & deadline);
+	bool m_is_poll; //false once the UART turns out not to support poll() (Stratify only)
+	int read_line(void * buf, int len, int nbyte);
+	int fill_rx_buffer();
+	int read_rx_buffer(void * buf, int nbyte);
+	u16 rx_buffer_count() const { return m_rx_head - m_rx_tail; }
+	void clear_rx_buffer(){ m_rx_head = 0; m_rx_tail = 0; m_rx_scan = 0; }
 	int read_return_code(u16 timeout);
 	int wait_response(const char * response, u16 timeout);
 	int wait_ok(u16 timeout);
+	int escalate_baud_rate(u32 crystal, u32 part_id);
+	int set_uart_baud_rate(u32 baud);
+	int confirm_baud_rate(u32 part_id);
+	static bool is_baud_rate_valid(u32 crystal, u32 baud);
 
 
 	bool is_return_code_newline(){ return m_is_return_code_newline; }
@@ -0,0 +1,211 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#include "UuEncodePipeline.hpp"
+
+#include <stdio.h>
+
+#include "isplib.h"
+#include "uu_encode.h"
+
+UuEncodePipeline::UuEncodePipeline(){
+	m_src = 0;
+	m_size = 0;
+	m_block_count = 0;
+	m_is_thread = false;
+	m_is_started = false;
+	m_is_job = false;
+	m_is_cancel = false;
+	m_is_exit = false;
+	m_slot_state[0] = SLOT_FREE;
+	m_slot_state[1] = SLOT_FREE;
+	pthread_mutex_init(&m_mutex, 0);
+	pthread_cond_init(&m_cond, 0);
+}
+
+UuEncodePipeline::~UuEncodePipeline(){
+	if( m_is_thread ){
+		finish();
+		pthread_mutex_lock(&m_mutex);
+		m_is_exit = true;
+		pthread_cond_broadcast(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+		pthread_join(m_thread, 0);
+	}
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+int UuEncodePipeline::start_thread(){
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+#if !defined __link
+	pthread_attr_setstacksize(&attr, UU_ENCODE_PIPELINE_STACK_SIZE);
+#endif
+	ret = pthread_create(&m_thread, &attr, worker, this);
+	pthread_attr_destroy(&attr);
+
+	if( ret != 0 ){
+		isplib_debug(1, "Failed to start encoder thread (%d)--encoding inline\n", ret);
+		return -1;
+	}
+
+	m_is_thread = true;
+	return 0;
+}
+
+int UuEncodePipeline::start(const void * src, u32 size){
+
+	finish();
+
+	if( m_is_thread == false ){
+		start_thread();
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	m_src = (const char*)src;
+	m_size = size;
+	m_block_count = (size + UU_BLOCK_BYTES - 1) / UU_BLOCK_BYTES;
+	m_slot_state[0] = SLOT_FREE;
+	m_slot_state[1] = SLOT_FREE;
+	m_is_cancel = false;
+	m_is_started = true;
+	m_is_job = m_is_thread;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	return 0;
+}
+
+const uu_block_t * UuEncodePipeline::wait_block(u32 index){
+	uu_block_t * block = m_slot + (index & 0x01);
+	u32 offset;
+
+	if( index >= m_block_count ){
+		return 0;
+	}
+
+	if( m_is_thread == false ){
+		if( (m_slot_state[index & 0x01] != SLOT_READY) || (m_slot_index[index & 0x01] != index) ){
+			offset = index*UU_BLOCK_BYTES;
+			encode_block(block, m_src + offset, m_size - offset);
+			m_slot_index[index & 0x01] = index;
+			m_slot_state[index & 0x01] = SLOT_READY;
+		}
+		return block;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	while( (m_slot_state[index & 0x01] != SLOT_READY) || (m_slot_index[index & 0x01] != index) ){
+		pthread_cond_wait(&m_cond, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return block;
+}
+
+void UuEncodePipeline::release_block(u32 index){
+	pthread_mutex_lock(&m_mutex);
+	m_is_started = false;
+	if( m_slot_index[index & 0x01] == index ){
+		m_slot_state[index & 0x01] = SLOT_FREE;
+	}
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void UuEncodePipeline::finish(){
+	pthread_mutex_lock(&m_mutex);
+	m_is_started = false;
+	m_is_cancel = true;
+	pthread_cond_broadcast(&m_cond);
+	while( m_is_job ){
+		pthread_cond_wait(&m_cond, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void * UuEncodePipeline::worker(void * args){
+	UuEncodePipeline * object = (UuEncodePipeline*)args;
+	object->run();
+	return 0;
+}
+
+void UuEncodePipeline::run(){
+	u32 index;
+	u32 offset;
+	u8 slot;
+
+	pthread_mutex_lock(&m_mutex);
+	while( m_is_exit == false ){
+
+		if( m_is_job == false ){
+			pthread_cond_wait(&m_cond, &m_mutex);
+			continue;
+		}
+
+		for(index=0; (index < m_block_count) && (m_is_cancel == false); index++){
+			slot = index & 0x01;
+
+			//wait for the transmit side to be done with this buffer
+			while( (m_slot_state[slot] != SLOT_FREE) && (m_is_cancel == false) ){
+				pthread_cond_wait(&m_cond, &m_mutex);
+			}
+
+			if( m_is_cancel ){
+				break;
+			}
+
+			m_slot_state[slot] = SLOT_BUSY;
+			m_slot_index[slot] = index;
+			offset = index*UU_BLOCK_BYTES;
+			pthread_mutex_unlock(&m_mutex);
+
+			encode_block(m_slot + slot, m_src + offset, m_size - offset);
+
+			pthread_mutex_lock(&m_mutex);
+			m_slot_state[slot] = SLOT_READY;
+			pthread_cond_broadcast(&m_cond);
+		}
+
+		m_is_job = false;
+		pthread_cond_broadcast(&m_cond);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+/*! \details Encodes up to one checksum block (20 lines) of \a src into \a block. */
+void UuEncodePipeline::encode_block(uu_block_t * block, const void * src, u32 size){
+	uint32_t checksum;
+
+	if( size > UU_BLOCK_BYTES ){
+		size = UU_BLOCK_BYTES;
+	}
+
+	//the checksum is calculated while the lines are encoded
+	checksum = 0;
+	block->size = uu_encode_block(block->data, src, size, &checksum);
+	block->bytes = size;
+	block->checksum = checksum;
+	block->lines = (size + UU_LINE_BYTES - 1) / UU_LINE_BYTES;
+
+	//the checksum line follows the data so the block can be sent with one write
+	block->frame_size = block->size + sprintf(block->data + block->size, "%ld\r\n", (long)checksum);
+}
@@ -0,0 +1,107 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#ifndef UUENCODEPIPELINE_HPP_
+#define UUENCODEPIPELINE_HPP_
+
+#include <pthread.h>
+#include <sapi/sys.hpp>
+
+#define UU_BLOCK_LINES 20 //the ISP sends a checksum every 20 lines
+#define UU_LINE_BYTES 45 //source bytes per full line
+#define UU_LINE_SIZE 63 //length character + 60 encoded characters + <CR><LF>
+#define UU_BLOCK_BYTES (UU_BLOCK_LINES*UU_LINE_BYTES)
+#define UU_CHECKSUM_SIZE 12 //checksum line: up to 10 digits + <CR><LF>
+
+#define UU_ENCODE_PIPELINE_STACK_SIZE 2048
+
+/*! \brief One checksum block of uuencoded lines followed by its checksum line */
+typedef struct {
+	char data[UU_BLOCK_LINES*UU_LINE_SIZE+UU_CHECKSUM_SIZE+1]; //+1 for the zero sprintf() appends
+	u16 size; //number of encoded bytes in data (not including the checksum line)
+	u16 frame_size; //size plus the checksum line
+	u16 bytes; //number of source bytes that were encoded
+	u32 checksum; //ISP checksum of the source bytes
+	u8 lines;
+} uu_block_t;
+
+/*! \brief Encodes checksum blocks ahead of the UART
+ * \details A worker thread uuencodes block N+1 into one buffer while the
+ * caller transmits block N from the other. Blocks stay in their buffer
+ * until they are released so a RESEND replays the block without encoding it again.
+ *
+ * If the worker thread can't be created, blocks are encoded
+ * when they are requested.
+ */
+class UuEncodePipeline {
+public:
+	UuEncodePipeline();
+	~UuEncodePipeline();
+
+	/*! \details Starts encoding \a size bytes from \a src (which must stay valid until finish()) */
+	int start(const void * src, u32 size);
+
+	/*! \details Returns true if encoding of \a src has started and none of it has been released */
+	bool is_started(const void * src, u32 size) const {
+		return m_is_started && (m_src == src) && (m_size == size);
+	}
+
+	/*! \details Waits for block \a index to be encoded */
+	const uu_block_t * wait_block(u32 index);
+
+	/*! \details Allows the buffer holding block \a index to be reused */
+	void release_block(u32 index);
+
+	/*! \details Stops the current job and waits for the worker to let go of the source data */
+	void finish();
+
+	u32 block_count() const { return m_block_count; }
+
+	static void encode_block(uu_block_t * block, const void * src, u32 size);
+
+private:
+	enum {
+		SLOT_FREE,
+		SLOT_BUSY,
+		SLOT_READY
+	};
+
+	static void * worker(void * args);
+	void run();
+	int start_thread();
+
+	uu_block_t m_slot[2];
+	u32 m_slot_index[2];
+	u8 m_slot_state[2];
+
+	const char * m_src;
+	u32 m_size;
+	u32 m_block_count;
+
+	pthread_t m_thread;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	bool m_is_thread;
+	bool m_is_started;
+	bool m_is_job;
+	bool m_is_cancel;
+	bool m_is_exit;
+
+};
+
+#endif /* UUENCODEPIPELINE_HPP_ */
@@ -0,0 +1,54 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#include "crc32.h"
+
+static uint32_t crc32_table[256];
+static int crc32_table_ready = 0;
+
+static void crc32_init_table(){
+	uint32_t c;
+	int i;
+	int j;
+	for(i=0; i < 256; i++){
+		c = i;
+		for(j=0; j < 8; j++){
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		}
+		crc32_table[i] = c;
+	}
+	crc32_table_ready = 1;
+}
+
+/*! \details Calculates the CRC32 (IEEE 802.3, same as the ISP "S" command) of \a src.
+ * Pass zero as \a crc to start and the previous result to continue.
+ */
+uint32_t crc32_calc(uint32_t crc, const void * src, uint32_t bytes){
+	const uint8_t * p = src;
+	uint32_t i;
+
+	if( crc32_table_ready == 0 ){
+		crc32_init_table();
+	}
+
+	crc = ~crc;
+	for(i=0; i < bytes; i++){
+		crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
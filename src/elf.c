@@ -0,0 +1,79 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#include "elf.h"
+
+static uint32_t elf_u32(const uint8_t * src){
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static uint16_t elf_u16(const uint8_t * src){
+	return src[0] | (src[1] << 8);
+}
+
+/*! \details Returns non-zero if \a src starts with the ELF magic number */
+int elf_is_header(const void * src, uint32_t size){
+	const uint8_t * p = src;
+	return (size >= 4) && (p[0] == 0x7F) && (p[1] == 'E') && (p[2] == 'L') && (p[3] == 'F');
+}
+
+/*! \details Parses the ELF header at \a src.
+ * \return Zero on success or -1 if \a src isn't a 32-bit little endian ARM executable
+ */
+int elf_parse_header(const void * src, uint32_t size, elf_header_t * header){
+	const uint8_t * p = src;
+
+	if( (size < ELF_HEADER_SIZE) || (elf_is_header(src, size) == 0) ){
+		return -1;
+	}
+
+	//32-bit, little endian, ARM
+	if( (p[4] != 1) || (p[5] != 1) || (elf_u16(p + 18) != 40) ){
+		return -1;
+	}
+
+	header->entry = elf_u32(p + 24);
+	header->phoff = elf_u32(p + 28);
+	header->phentsize = elf_u16(p + 42);
+	header->phnum = elf_u16(p + 44);
+
+	if( (header->phnum > 0) && (header->phentsize < ELF_PROGRAM_HEADER_SIZE) ){
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \details Parses the program header at \a src */
+int elf_parse_program_header(const void * src, uint32_t size, elf_program_header_t * program_header){
+	const uint8_t * p = src;
+
+	if( size < ELF_PROGRAM_HEADER_SIZE ){
+		return -1;
+	}
+
+	program_header->type = elf_u32(p);
+	program_header->offset = elf_u32(p + 4);
+	program_header->vaddr = elf_u32(p + 8);
+	program_header->paddr = elf_u32(p + 12);
+	program_header->filesz = elf_u32(p + 16);
+	program_header->memsz = elf_u32(p + 20);
+	program_header->flags = elf_u32(p + 24);
+	program_header->align = elf_u32(p + 28);
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+#ifndef ELF_H_
+#define ELF_H_
+
+#include <stdint.h>
+
+#define ELF_HEADER_SIZE 52 //32-bit ELF header
+#define ELF_PROGRAM_HEADER_SIZE 32 //32-bit ELF program header
+#define ELF_PT_LOAD 1
+
+typedef struct {
+	uint32_t entry;
+	uint32_t phoff; //file offset of the program headers
+	uint16_t phentsize;
+	uint16_t phnum;
+} elf_header_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t offset; //file offset of the segment
+	uint32_t vaddr;
+	uint32_t paddr; //load address
+	uint32_t filesz;
+	uint32_t memsz;
+	uint32_t flags;
+	uint32_t align;
+} elf_program_header_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int elf_is_header(const void * src, uint32_t size);
+int elf_parse_header(const void * src, uint32_t size, elf_header_t * header);
+int elf_parse_program_header(const void * src, uint32_t size, elf_program_header_t * program_header);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ELF_H_ */
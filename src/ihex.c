@@ -0,0 +1,117 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#include "ihex.h"
+
+static const char ihex_digits[] = "0123456789ABCDEF";
+
+static char * ihex_byte(char * dest, uint8_t value, uint8_t * checksum){
+	*dest++ = ihex_digits[value >> 4];
+	*dest++ = ihex_digits[value & 0x0F];
+	*checksum += value;
+	return dest;
+}
+
+/*! \details Formats one Intel HEX record (":LLAAAATT<data>CC<LF>") in \a dest.
+ * \a dest must hold at least IHEX_RECORD_SIZE(\a size) bytes.
+ * \return The number of characters written (not including the zero terminator)
+ */
+int ihex_record(char * dest, uint8_t type, uint16_t addr, const void * data, uint8_t size){
+	const uint8_t * p = data;
+	char * start = dest;
+	uint8_t checksum;
+	int i;
+
+	checksum = 0;
+	*dest++ = ':';
+	dest = ihex_byte(dest, size, &checksum);
+	dest = ihex_byte(dest, addr >> 8, &checksum);
+	dest = ihex_byte(dest, addr & 0xFF, &checksum);
+	dest = ihex_byte(dest, type, &checksum);
+	for(i=0; i < size; i++){
+		dest = ihex_byte(dest, p[i], &checksum);
+	}
+	checksum = 0x100 - checksum;
+	dest = ihex_byte(dest, checksum, &checksum);
+	*dest++ = '\n';
+	*dest = 0;
+	return dest - start;
+}
+
+/*! \details Converts \a digits hex characters at \a src to a value.
+ * \return The value or -1 if a character isn't a hex digit
+ */
+int ihex_hex_value(const char * src, int digits){
+	int value = 0;
+	int i;
+	char c;
+
+	for(i=0; i < digits; i++){
+		c = src[i];
+		if( (c >= '0') && (c <= '9') ){
+			value = (value << 4) | (c - '0');
+		} else if( (c >= 'A') && (c <= 'F') ){
+			value = (value << 4) | (c - 'A' + 10);
+		} else if( (c >= 'a') && (c <= 'f') ){
+			value = (value << 4) | (c - 'a' + 10);
+		} else {
+			return -1;
+		}
+	}
+	return value;
+}
+
+/*! \details Parses the Intel HEX record at \a src (":LLAAAATT<data>CC").
+ * \return Zero on success or -1 if \a src isn't a valid record
+ */
+int ihex_parse_record(const char * src, ihex_record_t * record){
+	uint8_t checksum;
+	int value;
+	int size;
+	int i;
+
+	if( src[0] != ':' ){
+		return -1;
+	}
+	src++;
+
+	if( (size = ihex_hex_value(src, 2)) < 0 ){
+		return -1;
+	}
+
+	//size, address, type, data and checksum bytes
+	checksum = 0;
+	for(i=0; i < size + 5; i++){
+		if( (value = ihex_hex_value(src + i*2, 2)) < 0 ){
+			return -1;
+		}
+		checksum += value;
+		if( (i >= 4) && (i < size + 4) ){
+			record->data[i-4] = value;
+		}
+	}
+
+	if( checksum != 0 ){
+		return -1;
+	}
+
+	record->size = size;
+	record->addr = ihex_hex_value(src + 2, 4);
+	record->type = ihex_hex_value(src + 6, 2);
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+#ifndef IHEX_H_
+#define IHEX_H_
+
+#include <stdint.h>
+
+#define IHEX_DATA 0x00
+#define IHEX_EOF 0x01
+#define IHEX_EXTENDED_SEGMENT_ADDR 0x02
+#define IHEX_EXTENDED_LINEAR_ADDR 0x04
+
+#define IHEX_RECORD_BYTES 16 //data bytes per data record
+#define IHEX_RECORD_SIZE(bytes) (13 + (bytes)*2) //characters for a record with <LF> and zero
+
+typedef struct {
+	uint8_t type;
+	uint8_t size;
+	uint16_t addr;
+	uint8_t data[255];
+} ihex_record_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ihex_record(char * dest, uint8_t type, uint16_t addr, const void * data, uint8_t size);
+int ihex_parse_record(const char * src, ihex_record_t * record);
+int ihex_hex_value(const char * src, int digits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IHEX_H_ */
@@ -0,0 +1,94 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#ifndef LPC_ARTIFACT_H_
+#define LPC_ARTIFACT_H_
+
+#include <stdint.h>
+
+/*
+ * Layout of a prepared image (artifact).
+ *
+ * An artifact is made once from an image for one device (see LpcIsp::prepare()).
+ * It holds everything program() would otherwise work out on every run: the
+ * segments, the vector checksum, the sector CRCs, which pages are written and
+ * the pages themselves already split into write to RAM chunks and uuencoded
+ * checksum blocks. Multi-byte fields are little endian.
+ *
+ * lpc_artifact_header_t
+ * lpc_artifact_segment_t[segment_count]
+ * uint32_t sector_crc[sector_count]
+ * uint32_t page_table[page_count] -- file offset of each page record (0 if the page isn't written)
+ * page records
+ *
+ * A page record is an lpc_artifact_page_t followed by size bytes. For
+ * uuencoded devices these are blocks: an lpc_artifact_block_t followed by
+ * frame_size bytes (the encoded lines and the checksum line) padded to a
+ * multiple of 4. Otherwise they are the copy_size bytes of the page.
+ *
+ */
+
+#define LPC_ARTIFACT_MAGIC 0x3141504C //"LPA1"
+#define LPC_ARTIFACT_VERSION 1
+#define LPC_ARTIFACT_DEVICE_SIZE 16
+#define LPC_ARTIFACT_PATH_SIZE 128
+#define LPC_ARTIFACT_MAX_PAGE_SIZE 6144 //a 4096 byte page in 1024 byte chunks of 900 and 124 byte blocks
+
+#define LPC_ARTIFACT_FLAG_UUENCODE (1<<0) //page records are uuencoded blocks
+#define LPC_ARTIFACT_FLAG_CHECKSUM (1<<1) //checksum was written to the vector checksum
+
+typedef struct {
+	uint32_t magic; //LPC_ARTIFACT_MAGIC
+	uint32_t version; //LPC_ARTIFACT_VERSION
+	char device[LPC_ARTIFACT_DEVICE_SIZE];
+	char source[LPC_ARTIFACT_PATH_SIZE]; //image the artifact was made from
+	uint32_t source_size;
+	uint32_t source_crc; //CRC32 of the whole source file
+	uint32_t page_size; //bytes per copy RAM to flash
+	uint32_t chunk_size; //bytes per write to RAM command
+	uint32_t o_flags; //LPC_ARTIFACT_FLAG_*
+	uint32_t checksum;
+	uint32_t end; //address after the last segment
+	uint32_t size; //address after the last byte that isn't 0xFF
+	uint32_t segment_count;
+	uint32_t sector_count;
+	uint32_t page_count;
+	uint32_t used_pages;
+} lpc_artifact_header_t;
+
+typedef struct {
+	uint32_t addr;
+	uint32_t size;
+} lpc_artifact_segment_t;
+
+typedef struct {
+	uint32_t addr;
+	uint32_t bytes; //image bytes in the page
+	uint32_t copy_size; //bytes copied to flash (bytes padded with 0xFF)
+	uint32_t size; //bytes in the record after this header
+} lpc_artifact_page_t;
+
+typedef struct {
+	uint16_t frame_size; //encoded lines plus the checksum line
+	uint16_t bytes; //source bytes in the block
+	uint32_t checksum; //ISP checksum of the source bytes
+} lpc_artifact_block_t;
+
+#define LPC_ARTIFACT_BLOCK_SIZE(frame_size) (sizeof(lpc_artifact_block_t) + (((frame_size) + 3) & ~0x03))
+
+#endif /* LPC_ARTIFACT_H_ */
@@ -27,6 +27,10 @@ typedef struct {
 	char prefix[12];
 	uint32_t checksum_addr;
 	uint32_t ram_start;
+	uint32_t ram_size; //bytes the host may use starting at ram_start
+	uint32_t copy_size; //largest copy RAM to flash ("C") the bootloader accepts
+	uint16_t crc_boot_version; //first bootloader version (major*256 + minor) with read CRC ("S") or 0
+	uint8_t command_pair; //the ISP UART buffers a copy or erase sent right behind its prepare
 	uint16_t sectors;
 	uint16_t sector_table[128];
 } lpc_device_t;
@@ -38,12 +42,18 @@ static lpc_device_t devices[] = {
 		{
 				.prefix = "lpc21",
 				.checksum_addr = 0x14,
-				.ram_start = 0x40000300
+				.ram_start = 0x40000300,
+				.ram_size = 0x400,
+				.copy_size = 4096,
+				.command_pair = 1
 		},
 		{
 				.prefix = "lpc8",
 				.checksum_addr = 0x1C,
 				.ram_start = 0x10000400,
+				.ram_size = 0x400,
+				.copy_size = 1024,
+				.crc_boot_version = 0x0D04,
 				.sectors = 32,
 				.sector_table[0] = 1024,
 				.sector_table[1] = 1024,
@@ -82,6 +92,9 @@ static lpc_device_t devices[] = {
 				.prefix = "lpc13",
 				.checksum_addr = 0x1C,
 				.ram_start = 0x10000300,
+				.ram_size = 0x800,
+				.copy_size = 4096,
+				.command_pair = 1,
 				.sectors = 8,
 				.sector_table[0] = 4096,
 				.sector_table[1] = 4096,
@@ -97,6 +110,9 @@ static lpc_device_t devices[] = {
 				.prefix = "lpc17",
 				.checksum_addr = 0x1C,
 				.ram_start = 0x10000300,
+				.ram_size = 0x1A00,
+				.copy_size = 4096,
+				.command_pair = 1,
 				.sectors = 30,
 				.sector_table[0] = 4096,
 				.sector_table[1] = 4096,
@@ -136,6 +152,9 @@ static lpc_device_t devices[] = {
 				.prefix = "lpc40",
 				.checksum_addr = 0x1C,
 				.ram_start = 0x10000300,
+				.ram_size = 0x3C00,
+				.copy_size = 4096,
+				.command_pair = 1,
 				.sectors = 30,
 				.sector_table[0] = 4096,
 				.sector_table[1] = 4096,
@@ -197,6 +216,93 @@ uint32_t lpc_device_get_ram_start(const char * dev){
 	return -1;
 }
 
+uint32_t lpc_device_get_ram_size(const char * dev){
+	int i;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			return devices[i].ram_size;
+		}
+	}
+	return 0;
+}
+
+uint32_t lpc_device_get_ram_buffer_size(const char * dev){
+	//sizes that copy RAM to flash accepts on every family
+	static const uint32_t copy_sizes[] = { 4096, 1024, 512, 256, 0 };
+	int i;
+	int j;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			for(j=0; copy_sizes[j] != 0; j++){
+				if( (copy_sizes[j] <= devices[i].copy_size) && (copy_sizes[j] <= devices[i].ram_size) ){
+					return copy_sizes[j];
+				}
+			}
+			return 256;
+		}
+	}
+	return 1024;
+}
+
+uint32_t lpc_device_get_crc_boot_version(const char * dev){
+	int i;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			return devices[i].crc_boot_version;
+		}
+	}
+	return 0;
+}
+
+uint32_t lpc_device_get_command_pair(const char * dev){
+	int i;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			return devices[i].command_pair;
+		}
+	}
+	return 0;
+}
+
+uint32_t lpc_device_get_sector_count(const char * dev){
+	int i;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			return devices[i].sectors;
+		}
+	}
+	return 0;
+}
+
+uint32_t lpc_device_get_sector_addr(const char * dev, uint32_t sector){
+	uint32_t addr;
+	uint32_t j;
+	int i;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			addr = 0;
+			for(j=0; (j < sector) && (j < devices[i].sectors); j++){
+				addr += devices[i].sector_table[j];
+			}
+			return addr;
+		}
+	}
+	return 0;
+}
+
+uint32_t lpc_device_get_sector_size(const char * dev, uint32_t sector){
+	int i;
+	for(i=0; i < TOTAL_DEVICES; i++){
+		if ( !strncmp(dev, devices[i].prefix, strlen(devices[i].prefix)) ){
+			if( sector < devices[i].sectors ){
+				return devices[i].sector_table[sector];
+			}
+			return 0;
+		}
+	}
+	return 0;
+}
+
 uint32_t lpc_device_get_sector_number(const char * dev, uint32_t addr){
 	int i;
 	for(i=0; i < TOTAL_DEVICES; i++){
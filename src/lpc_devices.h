@@ -27,6 +27,13 @@ extern "C" {
 
 int32_t lpc_device_get_checksum_addr(const char * dev);
 uint32_t lpc_device_get_ram_start(const char * dev);
+uint32_t lpc_device_get_ram_size(const char * dev);
+uint32_t lpc_device_get_ram_buffer_size(const char * dev);
+uint32_t lpc_device_get_crc_boot_version(const char * dev);
+uint32_t lpc_device_get_command_pair(const char * dev);
+uint32_t lpc_device_get_sector_count(const char * dev);
+uint32_t lpc_device_get_sector_addr(const char * dev, uint32_t sector);
+uint32_t lpc_device_get_sector_size(const char * dev, uint32_t sector);
 uint32_t lpc_device_get_sector_number(const char * dev, uint32_t addr);
 
 #ifdef __cplusplus
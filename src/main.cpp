@@ -28,6 +28,7 @@ limitations under the License.
 #include "AppMessenger.hpp"
 
 static void show_usage(const char * name);
+static const u32 * parse_baud_ladder(const char * arg);
 
 
 static bool update_status(void * context, const char * status);
@@ -83,6 +84,36 @@ int main(int argc, char * argv[]){
 	}
 
 
+	if( cli.is_option("-prepare") ){
+		//no device is connected to prepare an artifact
+		if( (cli.is_option("-in") == false) || (cli.is_option("-d") == false) ){
+			printf("-prepare needs an input file (-in) and a device (-d)\n");
+			show_usage(argv[0]);
+			exit(1);
+		}
+
+		image = cli.get_option_argument("-in");
+		device = cli.get_option_argument("-d");
+
+		Uart uart(0);
+		Pin reset(1, 0);
+		Pin ispreq(2, 10);
+		LpcIsp isp(uart, reset, ispreq);
+
+		isp.set_context(current_messenger);
+		isp.set_status_callback(update_status);
+
+		if( cli.is_option("-patch") ){
+			if( isp.load_patches(cli.get_option_argument("-patch").c_str()) < 0 ){
+				update_status(current_messenger, "Failed to load patches\n");
+				exit(1);
+			}
+		}
+
+		ret = isp.prepare(image.c_str(), device.c_str(), cli.get_option_argument("-prepare").c_str());
+		exit(ret < 0 ? 1 : 0);
+	}
+
 	if( cli.is_option("-uart") ){
 
 		cli.handle_uart(uart_attr);
@@ -124,6 +155,67 @@ int main(int argc, char * argv[]){
 
 		LpcIsp isp(uart, reset, ispreq);
 
+		if( cli.is_option("-baud") ){
+			isp.set_baud_ladder( parse_baud_ladder(cli.get_option_argument("-baud")) );
+		}
+
+		if( cli.is_option("-nopipeline") ){
+			isp.set_encode_pipeline(false);
+		}
+
+		if( cli.is_option("-nobatch") ){
+			isp.set_batch_write(false);
+		}
+
+		if( cli.is_option("-nopair") ){
+			isp.set_command_pair(false);
+		}
+
+		if( cli.is_option("-speculate") ){
+			isp.set_speculate();
+		}
+
+		if( cli.is_option("-verify") ){
+			String verify = cli.get_option_argument("-verify");
+			if( verify == "sector" ){
+				isp.set_verify(LpcPhy::VERIFY_SECTOR);
+			} else if( verify == "image" ){
+				isp.set_verify(LpcPhy::VERIFY_IMAGE);
+			} else if( verify == "none" ){
+				isp.set_verify(LpcPhy::VERIFY_NONE);
+			} else {
+				isp.set_verify(LpcPhy::VERIFY_PAGE);
+			}
+		}
+
+		if( cli.is_option("-erase") ){
+			String erase = cli.get_option_argument("-erase");
+			if( erase == "all" ){
+				isp.set_erase_mode(LpcIsp::ERASE_ALL);
+			} else {
+				isp.set_erase_mode(LpcIsp::ERASE_IMAGE);
+			}
+		}
+
+		if( cli.is_option("-skipblank") ){
+			isp.set_skip_blank();
+		}
+
+		if( cli.is_option("-delta") ){
+			isp.set_delta();
+		}
+
+		if( cli.is_option("-patch") ){
+			if( isp.load_patches(cli.get_option_argument("-patch").c_str()) < 0 ){
+				update_status(current_messenger, "Failed to load patches\n");
+				exit(1);
+			}
+		}
+
+		if( cli.is_option("-dryrun") ){
+			isp.set_dry_run();
+		}
+
 		update_status(current_messenger, "Init Phy\n");
 
 		UartPinAssignment pin_assignment;
@@ -155,6 +247,21 @@ int main(int argc, char * argv[]){
 			}
 		} else {
 			printf("Read: %s from %s\n", image.c_str(), device.c_str());
+
+			isp.set_context(current_messenger);
+			isp.set_progress_callback(update_progress);
+			isp.set_status_callback(update_status);
+
+			u32 addr = 0;
+			u32 size = 0;
+			if( cli.is_option("-addr") ){
+				addr = strtoul(cli.get_option_argument("-addr").c_str(), 0, 0);
+			}
+			if( cli.is_option("-size") ){
+				size = strtoul(cli.get_option_argument("-size").c_str(), 0, 0);
+			}
+			isp.set_read_range(addr, size);
+
 			isp.read(image.c_str(), 12000000, device.c_str());
 			update_status(current_messenger, "Done\n");
 			exit(1);
@@ -175,14 +282,52 @@ void show_usage(const char * name){
 	printf("\t%s [-uart X] [-r X.Y] [-i X.Y] [-d device] [-in path] [-rx X.Y] [-tx X.Y]\n", name);
 	printf("\t\t-r X.Y is the pin connected to reset\n");
 	printf("\t\t-i X.Y is the pin connected to ISP request\n");
-	printf("\t\t-in path to local image\n");
+	printf("\t\t-in path to local image (binary, Intel HEX, S-record, ELF or an artifact made with -prepare)\n");
 	printf("\t\t-d is the device (e.g. lpc4078)\n");
 	printf("\t\t-rx X.Y is the UART rx pin (optional)\n");
 	printf("\t\t-tx X.Y is the UART tx pin (optional)\n");
 	printf("\t\t-message X.Y send message data on /dev/fifo channels X.Y\n");
+	printf("\t\t-verify page|sector|image|none when to verify flash (default page)\n");
+	printf("\t\t-erase image|all erase only the sectors the image uses or the whole device (default image)\n");
+	printf("\t\t-skipblank blank check before erasing or reading and skip sectors that are already blank\n");
+	printf("\t\t-delta only erase and write sectors that differ from the image\n");
+	printf("\t\t-patch path write the bytes listed in path over the image (lines of: address hex-bytes)\n");
+	printf("\t\t-prepare path save the -in image prepared for -d as an artifact in path (no -uart needed)\n");
+	printf("\t\t-dryrun connect and plan programming, then report the estimated time without erasing or writing\n");
+	printf("\t\t-nopipeline encode and send one line at a time (for comparison)\n");
+	printf("\t\t-nobatch write each line separately instead of one write per block (for comparison)\n");
+	printf("\t\t-nopair wait for the return code of prepare before copy or erase (for comparison)\n");
+	printf("\t\t-speculate send the next block before the checksum response of the last one (falls back if not accepted)\n");
+	printf("\t\t-read copy flash to the -in path instead of programming it (Intel HEX if the path ends in .hex)\n");
+	printf("\t\t-addr X -size Y range to read (default the whole flash)\n");
+	printf("\t\t-baud X,Y,... bit rates to try after sync (default 230400,460800,921600; 0 to disable)\n");
 	printf("e.g: lpcprog -uart 0 -r 1.0 -i 2.10 -in /home/boot-image.bin -d lpc4078\n");
 }
 
+const u32 * parse_baud_ladder(const char * arg){
+	static u32 ladder[8];
+	char * end;
+	int i;
+
+	for(i=0; i < 7; i++){
+		ladder[i] = strtoul(arg, &end, 10);
+		if( (end == arg) || (ladder[i] == 0) ){
+			break;
+		}
+		if( *end != ',' ){
+			i++;
+			break;
+		}
+		arg = end + 1;
+	}
+	ladder[i] = 0;
+
+	if( ladder[0] == 0 ){
+		return 0;
+	}
+	return ladder;
+}
+
 bool update_progress(void * context, int progress, int max){
 	AppMessenger * messenger = (AppMessenger*)context;
 
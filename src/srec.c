@@ -0,0 +1,76 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+
+#include "srec.h"
+#include "ihex.h"
+
+/*! \details Parses the Motorola S-record at \a src ("S<type><count><address><data><checksum>").
+ * \return Zero on success or -1 if \a src isn't a valid record
+ */
+int srec_parse_record(const char * src, srec_record_t * record){
+	uint8_t checksum;
+	int addr_size;
+	int count;
+	int value;
+	int i;
+
+	if( (src[0] != 'S') || (src[1] < '0') || (src[1] > '9') ){
+		return -1;
+	}
+
+	switch(src[1]){
+	case '2':
+	case '8':
+		addr_size = 3;
+		break;
+	case '3':
+	case '7':
+		addr_size = 4;
+		break;
+	default:
+		addr_size = 2;
+		break;
+	}
+
+	//count covers the address, data and checksum bytes
+	if( ((count = ihex_hex_value(src + 2, 2)) < 0) || (count < addr_size + 1) ){
+		return -1;
+	}
+
+	checksum = count;
+	record->addr = 0;
+	for(i=0; i < count; i++){
+		if( (value = ihex_hex_value(src + 4 + i*2, 2)) < 0 ){
+			return -1;
+		}
+		checksum += value;
+		if( i < addr_size ){
+			record->addr = (record->addr << 8) | value;
+		} else if( i < count - 1 ){
+			record->data[i - addr_size] = value;
+		}
+	}
+
+	if( checksum != 0xFF ){
+		return -1;
+	}
+
+	record->type = src[1];
+	record->size = count - addr_size - 1;
+	return 0;
+}
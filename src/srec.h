@@ -0,0 +1,43 @@
+/*
+
+Copyright 2011-2017 Tyler Gilbert
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+ */
+#ifndef SREC_H_
+#define SREC_H_
+
+#include <stdint.h>
+
+#define SREC_IS_DATA(type) (((type) >= '1') && ((type) <= '3'))
+#define SREC_IS_END(type) (((type) >= '7') && ((type) <= '9'))
+
+typedef struct {
+	char type; //'0' to '9'
+	uint8_t size; //data bytes
+	uint32_t addr;
+	uint8_t data[255];
+} srec_record_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int srec_parse_record(const char * src, srec_record_t * record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SREC_H_ */
@@ -26,86 +26,199 @@ limitations under the License.
 
 #include "isplib.h"
 
-static void uu_encode_word24(char * dest_uu, char * src);
-static void uu_decode_word24(char * dest, char * src_uu);
-static char uu_encode_char6(char in);
-static char uu_decode_char8(char in);
-unsigned short CRC = 0x0000;  /* CRC-16 accumulator */
-
-/*! \brief encodes a six bit word.
- *
- */
-static char uu_encode_char6(char in){
-	char out;
-	out = (in & 0x3F) + ' ';
-	if ( out == ' ' ){
-		out = '`';
+#if defined __link && defined __SSE2__
+#include <emmintrin.h>
+#define UU_SUM_SSE2
+#elif defined __link && defined __ARM_NEON
+#include <arm_neon.h>
+#define UU_SUM_NEON
+#endif
+
+#define UU_LINE_MAX_BYTES 45
+
+//six bit values to characters (0 is sent as '`' rather than ' ')
+static const char uu_encode_table[64] =
+		"`!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_";
+
+#define uu_decode_char(c) (((c) - ' ') & 0x3F)
+
+#if defined UU_SUM_SSE2 || defined UU_SUM_NEON
+/*! \details Adds up \a bytes bytes using SIMD (host builds only). */
+static uint32_t uu_sum(const uint8_t * src, uint32_t bytes){
+	uint32_t sum;
+	uint32_t i;
+
+	i = 0;
+#if defined UU_SUM_SSE2
+	__m128i acc = _mm_setzero_si128();
+	const __m128i zero = _mm_setzero_si128();
+	for(; i + 16 <= bytes; i += 16){
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(src + i)), zero));
 	}
-	return out;
-}
-
-
-static char uu_decode_char8(char in){
-	char out;
-	out = (in - ' ') & 0x3F;
-	return out;
-}
-
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#else
+	uint32x4_t acc = vdupq_n_u32(0);
+	for(; i + 16 <= bytes; i += 16){
+		acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(src + i)));
+	}
+	sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
 
-static void uu_encode_word24(char * dest_uu, char * src){
-	//encodes 3 bytes of data using UU encoding
-	int i;
-	char b[4];
-	isplib_debug(5, "Input is %X %X %X\n",
-				(uint8_t)src[0],
-				(uint8_t)src[1],
-				(uint8_t)src[2] );
-	b[0] = (src[0] & 0xFC) >> 2;
-	b[1] = ((src[0] & 0x03) << 4) + ((src[1] & 0xF0) >> 4);
-	b[2] = ((src[1] & 0x0F) << 2) + ((src[2] & 0xC0) >> 6);
-	b[3] = (src[2] & 0x3F);
-	for(i=0; i < 4; i++){
-		dest_uu[i] = uu_encode_char6( b[i] );
+	for(; i < bytes; i++){
+		sum += src[i];
 	}
-	isplib_debug(5, "Output is %X %X %X %X\n",
-					(uint8_t)dest_uu[0],
-					(uint8_t)dest_uu[1],
-					(uint8_t)dest_uu[2],
-					(uint8_t)dest_uu[3]);
+	return sum;
 }
+#endif
 
+/*! \brief encodes a block of data using uu encoding.
+ * \details This function encodes \a bytes bytes as lines of up to 45 bytes each
+ * ending in <CR><LF>. The destination is zero terminated. If \a checksum isn't null,
+ * the ISP checksum (sum of the source bytes) is added to it in the same pass.
+ * \return Length of the encoded data (not including the zero)
+ */
+uint32_t uu_encode_block(char * dest /*! Destination (63 bytes per 45 source bytes + 1) */,
+		const void * src /*! Source data */,
+		uint32_t bytes /*! Number of source bytes to encode */,
+		uint32_t * checksum /*! Accumulates the ISP checksum (can be null) */){
+	const uint8_t * s = (const uint8_t*)src;
+	char * d = dest;
+	uint32_t line_size;
+	uint32_t sum;
+	uint32_t i;
+	uint8_t a;
+	uint8_t b;
+	uint8_t c;
+
+	sum = 0;
+	while( bytes ){
+		line_size = bytes > UU_LINE_MAX_BYTES ? UU_LINE_MAX_BYTES : bytes;
+		*d++ = line_size + ' ';
+
+#if defined UU_SUM_SSE2 || defined UU_SUM_NEON
+		sum += uu_sum(s, line_size);
+#endif
+
+		for(i=0; i + 3 <= line_size; i += 3){
+			a = s[i];
+			b = s[i+1];
+			c = s[i+2];
+#if !defined UU_SUM_SSE2 && !defined UU_SUM_NEON
+			sum += a + b + c;
+#endif
+			d[0] = uu_encode_table[a >> 2];
+			d[1] = uu_encode_table[((a & 0x03) << 4) | (b >> 4)];
+			d[2] = uu_encode_table[((b & 0x0F) << 2) | (c >> 6)];
+			d[3] = uu_encode_table[c & 0x3F];
+			d += 4;
+		}
 
-static void uu_decode_word24(char * dest, char * src_uu){
-	uint8_t i;
-	char uu_dec[4];
-
-	isplib_debug(5, "uu_decode_word24():Input is %X %X %X %X\n",
-			(uint8_t)src_uu[0],
-			(uint8_t)src_uu[1],
-			(uint8_t)src_uu[2],
-			(uint8_t)src_uu[3]);
-
-	for(i=0; i < 4; i++) uu_dec[i] = uu_decode_char8(src_uu[i]);
-
+		if( i < line_size ){
+			//the last group is padded with zeros
+			a = s[i];
+			b = (i + 1 < line_size) ? s[i+1] : 0;
+#if !defined UU_SUM_SSE2 && !defined UU_SUM_NEON
+			sum += a + b;
+#endif
+			d[0] = uu_encode_table[a >> 2];
+			d[1] = uu_encode_table[((a & 0x03) << 4) | (b >> 4)];
+			d[2] = uu_encode_table[(b & 0x0F) << 2];
+			d[3] = uu_encode_table[0];
+			d += 4;
+		}
 
-	isplib_debug(5, "uu_decode_word24():Dec step 1 is %X %X %X %X\n",
-			(uint8_t)uu_dec[0],
-			(uint8_t)uu_dec[1],
-			(uint8_t)uu_dec[2],
-			(uint8_t)uu_dec[3]);
+		*d++ = '\r';
+		*d++ = '\n';
+		s += line_size;
+		bytes -= line_size;
+	}
+	*d = 0;
 
+	if( checksum ){
+		*checksum += sum;
+	}
+	return d - dest;
+}
 
-	dest[0] = ((uu_dec[0] & 0x3F) << 2) + ((uu_dec[1] & 0x30) >> 4);
-	dest[1] = ((uu_dec[1] & 0x0F) << 4) + ((uu_dec[2] & 0x3C) >> 2);
-	dest[2] = ((uu_dec[2] & 0x03) << 6) + (uu_dec[3] & 0x3F);
+/*! \brief decodes uu encoded lines.
+ * \details This function decodes consecutive lines from \a src until it runs
+ * out of data, finds a line that isn't uu encoded (such as a checksum) or
+ * \a dest_size is reached. Each line must end in <CR> or <LF>.
+ * \return Number of bytes written to \a dest
+ */
+uint32_t uu_decode_block(void * dest /*! Destination for the decoded data */,
+		uint32_t dest_size /*! Size of \a dest */,
+		const char * src /*! Encoded lines */,
+		uint32_t src_size /*! Number of bytes in \a src */,
+		uint32_t * consumed /*! Bytes of \a src that were decoded including line endings (can be null) */,
+		uint32_t * checksum /*! Accumulates the ISP checksum (can be null) */){
+	uint8_t * d = (uint8_t*)dest;
+	const char * line;
+	const char * end;
+	const char * p;
+	uint32_t line_size;
+	uint32_t encoded;
+	uint32_t decoded;
+	uint32_t sum;
+	uint32_t i;
+	uint8_t v0;
+	uint8_t v1;
+	uint8_t v2;
+	uint8_t v3;
+
+	line = src;
+	end = src + src_size;
+	decoded = 0;
+	sum = 0;
+	while( line < end ){
+		line_size = uu_decode_char(line[0]);
+		encoded = (line_size + 2) / 3 * 4;
+		if( (line_size == 0) ||
+				(line_size > UU_LINE_MAX_BYTES) ||
+				(line + 1 + encoded >= end) ||
+				((line[1 + encoded] != '\r') && (line[1 + encoded] != '\n')) ||
+				(decoded + line_size > dest_size) ){
+			break;
+		}
 
+		p = line + 1;
+		for(i=0; i < line_size; i += 3){
+			v0 = uu_decode_char(p[0]);
+			v1 = uu_decode_char(p[1]);
+			v2 = uu_decode_char(p[2]);
+			v3 = uu_decode_char(p[3]);
+			d[decoded + i] = (v0 << 2) | (v1 >> 4);
+			if( i + 1 < line_size ){
+				d[decoded + i + 1] = (v1 << 4) | (v2 >> 2);
+			}
+			if( i + 2 < line_size ){
+				d[decoded + i + 2] = (v2 << 6) | v3;
+			}
+			p += 4;
+		}
 
-	isplib_debug(5, "uu_decode_word24():Output is %X %X %X\n",
-			(uint8_t)dest[0],
-			(uint8_t)dest[1],
-			(uint8_t)dest[2]);
+#if defined UU_SUM_SSE2 || defined UU_SUM_NEON
+		sum += uu_sum(d + decoded, line_size);
+#else
+		for(i=0; i < line_size; i++){
+			sum += d[decoded + i];
+		}
+#endif
 
+		decoded += line_size;
+		line = p;
+		while( (line < end) && ((*line == '\r') || (*line == '\n')) ){
+			line++;
+		}
+	}
 
+	if( consumed ){
+		*consumed = line - src;
+	}
+	if( checksum ){
+		*checksum += sum;
+	}
+	return decoded;
 }
 
 /*! \brief encodes a line using uu encoding.
@@ -115,75 +228,16 @@ static void uu_decode_word24(char * dest, char * src_uu){
 char uu_encode_line(char * dest_uu /*! Pointer to the destination (= bytes * (1 + 1/3) ) */,
 		void * src /*! Pointer to the source (= to bytes) */,
 		uint8_t bytes /*! The number of source bytes to encode */){
-
-	char tmp[64];
-	uint8_t i;
-	uint8_t j;
-	char * dest = (char*)dest_uu;
-	memset(tmp, 0, 64);
-	memcpy(tmp, src, bytes);
-	dest[0] = (bytes & 0x3F) + ' ';  //this is the number of bytes encoded
-
-
-	j = 1;
-	for(i=0; i < bytes; i+=3){
-		uu_encode_word24(&dest[j], &tmp[i]);
-		j+=4;
+	if( bytes > UU_LINE_MAX_BYTES ){
+		bytes = UU_LINE_MAX_BYTES;
 	}
-
-
-
-	dest[j] = '\r';
-	dest[j+1] = '\n';
-	dest[j+2] = 0;
-
-	return strlen(dest);
+	return uu_encode_block(dest_uu, src, bytes, 0);
 }
 
 /*! \brief decodes a uu encoded line.
  * \details This function decodes a uu encoded line.
  * \return Length of decoded byte stream
  */
-
 char uu_decode_line(void * dest, char * src_uu, uint8_t bytes){
-	uint8_t i, j;
-	char * dest_p = (char*)dest;
-	char * src_p = (char*)src_uu;
-	uint8_t len;
-	uint8_t len_check;
-	//uint8_t en_bytes;
-
-	len = 0;
-	//en_bytes = (bytes * 4+2) / 3;
-
-	//isplib_debug(4, "Encoded bytes is %d\n", en_bytes);
-	//if ( en_bytes > 60 ) return 0;
-	//Check for proper line length
-	len_check = (src_p[0] - ' ') & 0x3F; //according to line decoding
-	if ( len_check > 45 ) return 0;
-	for(i=1; i < len_check*4/3+8; i++){
-		if ( (src_uu[i] == '\r') || (src_uu[i] == '\n') ){
-			len = i-1; //ignore the first char (length) and the last char '\r'
-			break;
-		}
-	}
-	memset(dest, 0, bytes);
-
-
-	len_check = (src_p[0] - ' ') & 0x3F; //according to line decoding
-
-	if ( ((len_check * 4) <= (len * 3 - 12)) ||
-			(len_check * 4 ) > (len*3) ){
-		isplib_debug(4, "check is %d, len is %d\n", len_check, len);
-		//return 0;
-	}
-
-	j = 1;
-	for(i=0; i < len; i+=3){
-		uu_decode_word24(&dest_p[i], &src_p[j]);
-		j+=4;
-	}
-
-	return len_check;
+	return uu_decode_block(dest, bytes, src_uu, strlen(src_uu), 0, 0);
 }
-
@@ -25,6 +25,9 @@ extern "C" {
 #endif
 
 
+uint32_t uu_encode_block(char * dest, const void * src, uint32_t bytes, uint32_t * checksum);
+uint32_t uu_decode_block(void * dest, uint32_t dest_size, const char * src, uint32_t src_size, uint32_t * consumed, uint32_t * checksum);
+
 char uu_encode_line(char * dest_uu, void * src, uint8_t bytes);
 char uu_decode_line(void * dest, char * src_uu, uint8_t bytes);
 